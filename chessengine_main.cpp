@@ -11,6 +11,9 @@
 #include <iomanip>
 #include <array>
 #include <cmath>
+#include <sstream>
+#include <atomic>
+#include <cstdlib>
 
 
 /*
@@ -22,6 +25,89 @@
 using namespace std;
 
 
+// =============================================================================
+// ========================= PERFT TRANSPOSITION TABLE =========================
+// =============================================================================
+// Optional cache of (Zobrist key, depth) -> node count. Enable it by setting the
+// environment variable PERFT_HASH_MB to the table size in megabytes, e.g.
+//
+//   PERFT_HASH_MB=256 ./MyChessEngine 6 "<fen>"
+//
+// It expects your Position to keep its Zobrist key in pos.hashKey (rename to match
+// your engine). The key must cover side to move, castling rights and the en-passant
+// square, otherwise different perft trees share an entry and the counts go wrong.
+//
+// Entries are written without locks so several search threads can share the table:
+// each slot stores (key ^ data, data), and a torn write from two racing threads
+// fails the key check on probe instead of returning a wrong count. Every bucket has
+// a depth-preferred slot and an always-replace slot.
+class PerftTT {
+public:
+    void resize(size_t megabytes) {
+        size_t buckets = 1;
+        while ((buckets * 2) * sizeof(Bucket) <= megabytes * 1024 * 1024) buckets *= 2;
+        table_ = std::vector<Bucket>(megabytes ? buckets : 0);
+        mask_ = buckets - 1;
+    }
+
+    bool enabled() const { return !table_.empty(); }
+
+    bool probe(uint64_t key, int depth, uint64_t& nodes) {
+        probes_.fetch_add(1, std::memory_order_relaxed);
+        Bucket& bucket = table_[key & mask_];
+        for (Slot& slot : bucket.slots) {
+            uint64_t data = slot.data.load(std::memory_order_relaxed);
+            uint64_t check = slot.keyXorData.load(std::memory_order_relaxed);
+            if ((check ^ data) == key && int(data & 0xFF) == depth) {
+                nodes = data >> 8;
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void store(uint64_t key, int depth, uint64_t nodes) {
+        Bucket& bucket = table_[key & mask_];
+        uint64_t data = (nodes << 8) | uint64_t(depth);
+        Slot& preferred = bucket.slots[0];
+        uint64_t old = preferred.data.load(std::memory_order_relaxed);
+        Slot& slot = depth >= int(old & 0xFF) ? preferred : bucket.slots[1];
+        slot.keyXorData.store(key ^ data, std::memory_order_relaxed);
+        slot.data.store(data, std::memory_order_relaxed);
+    }
+
+    // Hit rate goes to stderr: stdout is parsed by the debugger.
+    void reportAndReset() {
+        uint64_t probes = probes_.exchange(0), hits = hits_.exchange(0);
+        if (!enabled() || probes == 0) return;
+        std::cerr << "perft hash: " << hits << " hits / " << probes << " probes ("
+                  << std::fixed << std::setprecision(1) << 100.0 * hits / probes << "%)" << std::endl;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> keyXorData{0};
+        std::atomic<uint64_t> data{0};
+    };
+    struct Bucket {
+        Slot slots[2];
+    };
+
+    std::vector<Bucket> table_;
+    uint64_t mask_ = 0;
+    std::atomic<uint64_t> probes_{0};
+    std::atomic<uint64_t> hits_{0};
+};
+
+PerftTT perftTT;
+
+void initPerftTT() {
+    const char* size = std::getenv("PERFT_HASH_MB");
+    if (size) perftTT.resize(std::strtoull(size, nullptr, 10));
+}
+
+
 // =============================================================================
 // ================================= PERFT LOGIC ===============================
 // =============================================================================
@@ -30,6 +116,11 @@ uint64_t perft(Position& pos, int depth) {
     if (depth == 0) {
         return 1;
     }
+
+    uint64_t cached = 0;
+    if (perftTT.enabled() && depth >= 2 && perftTT.probe(pos.hashKey, depth, cached)) {
+        return cached;
+    }
     
     Moves legal_moves;
     if (pos.sideToMove == Color::White) {
@@ -53,49 +144,408 @@ uint64_t perft(Position& pos, int depth) {
         }
         nodes += perft(new_pos, depth - 1);
     }
+
+    if (perftTT.enabled() && depth >= 2) {
+        perftTT.store(pos.hashKey, depth, nodes);
+    }
     return nodes;
 }
 
-void runPerftAndPrint(Position& pos, int depth) {
-    if (depth == 0) {
-        std::cout << "\n1" << std::endl;
+// Second kernel: plays moves in place and takes them back, instead of copying the
+// whole Position per child. It is specialised on the side to move at compile time,
+// so there is no sideToMove branch per node, and it returns the legal move count
+// directly at depth 1 instead of visiting the leaves (bulk counting).
+//
+// It expects your Position to offer
+//   pos.makemove<Us>(move, undo)    -- saves what unmakemove needs in `undo`
+//   pos.unmakemove<Us>(move, undo)
+// with `UndoInfo` as the type of `undo` (rename to match your engine). The undo
+// records live in a fixed stack indexed by ply, so no node allocates.
+constexpr int MAX_PERFT_PLY = 128;
+
+template <Color Us>
+uint64_t perftInPlace(Position& pos, int depth, UndoInfo* undo) {
+    constexpr Color Them = (Us == Color::White) ? Color::Black : Color::White;
+
+    uint64_t cached = 0;
+    if (perftTT.enabled() && depth >= 2 && perftTT.probe(pos.hashKey, depth, cached)) {
+        return cached;
+    }
+
+    Moves legal_moves = pos.generateLegalMoves<Us>();
+    if (depth == 1) {
+        return legal_moves.count;
+    }
+
+    uint64_t nodes = 0;
+    for (int i = 0; i < legal_moves.count; i++) {
+        Move move = legal_moves.moves[i];
+        pos.makemove<Us>(move, *undo);
+        nodes += perftInPlace<Them>(pos, depth - 1, undo + 1);
+        pos.unmakemove<Us>(move, *undo);
+    }
+
+    if (perftTT.enabled()) {
+        perftTT.store(pos.hashKey, depth, nodes);
+    }
+    return nodes;
+}
+
+// Both kernels must agree; run the same query with PERFT_KERNEL=copy and
+// PERFT_KERNEL=inplace (the default) to cross-check a new makemove/unmakemove.
+enum class PerftKernel { Copy, InPlace };
+PerftKernel perftKernel = PerftKernel::InPlace;
+
+void initPerftKernel() {
+    const char* kernel = std::getenv("PERFT_KERNEL");
+    if (kernel && std::string(kernel) == "copy") {
+        perftKernel = PerftKernel::Copy;
+    }
+}
+
+// Checksum perft, requested by perftdebugger --checksum through PERFT_CHECKSUM=1.
+// Every leaf adds a hash of the move path reaching it from the debugger's FEN (the
+// moves it passed, then the moves below them) to its root move's checksum, so two bugs
+// whose node counts cancel out still show. The debugger computes exactly the same
+// hashes; keep these two functions as they are.
+bool perftChecksum = false;
+
+void initPerftChecksum() {
+    const char* checksum = std::getenv("PERFT_CHECKSUM");
+    perftChecksum = checksum && std::string(checksum) == "1";
+}
+
+constexpr uint64_t PATH_HASH_BASIS = 14695981039346656037ULL;
+
+// 64-bit FNV-1a over the move's UCI text and a trailing space.
+uint64_t pathHash(uint64_t hash, const std::string& uci) {
+    for (char c : uci) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    return (hash ^ static_cast<unsigned char>(' ')) * 1099511628211ULL;
+}
+
+// splitmix64 finalizer.
+uint64_t leafHash(uint64_t path) {
+    path = (path ^ (path >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    path = (path ^ (path >> 27)) * 0x94d049bb133111ebULL;
+    return path ^ (path >> 31);
+}
+
+uint64_t movesPathHash(const std::vector<std::string>& moves_vec) {
+    uint64_t hash = PATH_HASH_BASIS;
+    for (const std::string& move_uci : moves_vec) {
+        hash = pathHash(hash, move_uci);
+    }
+    return hash;
+}
+
+// Breakdown perft, requested by perftdebugger --breakdown through PERFT_BREAKDOWN=1.
+// Counts, among the leaves of each root move, those reached by a capture (en passant
+// included), an en passant capture, a castle or a promotion, and those where the side
+// to move is in check or checkmated, as in the perft tables on chessprogramming.org.
+// A counter that is off points at the bug: castles, say, or checks from discoveries.
+enum PerftCounter { Captures, EnPassant, Castles, Promotions, Checks, Mates, PERFT_COUNTERS };
+const char* const PERFT_COUNTER_NAMES[PERFT_COUNTERS] = {"captures", "ep", "castles", "promotions", "checks", "mates"};
+bool perftBreakdown = false;
+
+void initPerftBreakdown() {
+    const char* breakdown = std::getenv("PERFT_BREAKDOWN");
+    perftBreakdown = breakdown && std::string(breakdown) == "1";
+}
+
+struct PerftDetails {
+    uint64_t checksum = 0;
+    uint64_t counters[PERFT_COUNTERS] = {};
+};
+
+// Adds the leaf reached by playing `move` on pos; `path` already includes the move.
+// It expects
+//   move.isCapture() (en passant included), move.isEnPassant(), move.isCastle(),
+//   move.isPromotion(), and pos.inCheck<Side>() -- is Side's king attacked
+// (rename to match your engine).
+template <Color Us>
+void countLeaf(Position& pos, Move move, UndoInfo& undo, uint64_t path, bool checksum, PerftDetails& details) {
+    constexpr Color Them = (Us == Color::White) ? Color::Black : Color::White;
+    if (checksum) {
+        details.checksum += leafHash(path);
+    }
+    if (!perftBreakdown) {
         return;
     }
 
-    Moves legal_moves;
-    if (pos.sideToMove == Color::White) {
-        legal_moves = pos.generateLegalMoves<Color::White>();
-    } else {
-        legal_moves = pos.generateLegalMoves<Color::Black>();
+    if (move.isCapture()) details.counters[Captures]++;
+    if (move.isEnPassant()) details.counters[EnPassant]++;
+    if (move.isCastle()) details.counters[Castles]++;
+    if (move.isPromotion()) details.counters[Promotions]++;
+
+    pos.makemove<Us>(move, undo);
+    if (pos.inCheck<Them>()) {
+        details.counters[Checks]++;
+        if (pos.generateLegalMoves<Them>().count == 0) {
+            details.counters[Mates]++;
+        }
     }
-    
+    pos.unmakemove<Us>(move, undo);
+}
+
+// Perft for the checksum and breakdown modes: visits every leaf (no bulk counting, no
+// hash table) and adds it to `details` with countLeaf. Needs depth >= 1; returns the
+// node count.
+template <Color Us>
+uint64_t perftDetailed(Position& pos, int depth, uint64_t path, bool checksum, UndoInfo* undo, PerftDetails& details) {
+    constexpr Color Them = (Us == Color::White) ? Color::Black : Color::White;
+
+    Moves legal_moves = pos.generateLegalMoves<Us>();
+    uint64_t nodes = 0;
+    for (int i = 0; i < legal_moves.count; i++) {
+        Move move = legal_moves.moves[i];
+        uint64_t child_path = checksum ? pathHash(path, move.toUci()) : 0;
+        if (depth == 1) {
+            countLeaf<Us>(pos, move, *undo, child_path, checksum, details);
+            nodes++;
+            continue;
+        }
+        pos.makemove<Us>(move, *undo);
+        nodes += perftDetailed<Them>(pos, depth - 1, child_path, checksum, undo + 1, details);
+        pos.unmakemove<Us>(move, *undo);
+    }
+    return nodes;
+}
+
+// Counts every root move and hands it to report(move, nodes, details); stops early
+// when report returns false. `path` is movesPathHash of the moves leading to pos. The
+// details are filled in if `checksum` is set or breakdown perft is on. Shared by the
+// printed divide and the plugin interface.
+template <Color Us, typename Report>
+uint64_t divide(Position& pos, int depth, uint64_t path, bool checksum, Report&& report) {
+    constexpr Color Them = (Us == Color::White) ? Color::Black : Color::White;
+    UndoInfo undoStack[MAX_PERFT_PLY];
+
+    Moves legal_moves = pos.generateLegalMoves<Us>();
     uint64_t total_nodes = 0;
 
     for (int i = 0; i < legal_moves.count; i++) {
         Move move = legal_moves.moves[i];
-        Position new_pos = pos;
+        uint64_t nodes;
+        PerftDetails details;
 
-        if (new_pos.sideToMove == Color::White) {
-            new_pos.makemove<Color::White>(move);
+        if (checksum || perftBreakdown) {
+            uint64_t child_path = checksum ? pathHash(path, move.toUci()) : 0;
+            if (depth == 1) {
+                countLeaf<Us>(pos, move, undoStack[0], child_path, checksum, details);
+                nodes = 1;
+            } else {
+                pos.makemove<Us>(move, undoStack[0]);
+                nodes = perftDetailed<Them>(pos, depth - 1, child_path, checksum, undoStack + 1, details);
+                pos.unmakemove<Us>(move, undoStack[0]);
+            }
+        } else if (perftKernel == PerftKernel::InPlace) {
+            pos.makemove<Us>(move, undoStack[0]);
+            nodes = depth == 1 ? 1 : perftInPlace<Them>(pos, depth - 1, undoStack + 1);
+            pos.unmakemove<Us>(move, undoStack[0]);
         } else {
-            new_pos.makemove<Color::Black>(move);
+            Position new_pos = pos;
+            new_pos.makemove<Us>(move);
+            nodes = perft(new_pos, depth - 1);
         }
-        
-        uint64_t nodes = perft(new_pos, depth - 1);
         total_nodes += nodes;
-        
-        std::cout << move.toUci() << " " << nodes << std::endl;
+
+        if (!report(move, nodes, details)) break;
     }
+    return total_nodes;
+}
+
+// Prints "<move> <nodes>", with " hash=<hex>" and " captures=<n> ep=<n> ..." in the
+// checksum and breakdown modes.
+template <Color Us>
+void runDivide(Position& pos, int depth, uint64_t path) {
+    uint64_t total_nodes = divide<Us>(pos, depth, path, perftChecksum, [](Move move, uint64_t nodes, const PerftDetails& details) {
+        std::cout << move.toUci() << " " << nodes;
+        if (perftChecksum) {
+            std::cout << " hash=" << std::hex << std::setw(16) << std::setfill('0') << details.checksum
+                      << std::dec << std::setfill(' ');
+        }
+        if (perftBreakdown) {
+            for (int i = 0; i < PERFT_COUNTERS; i++) {
+                std::cout << " " << PERFT_COUNTER_NAMES[i] << "=" << details.counters[i];
+            }
+        }
+        std::cout << std::endl;
+        return true;
+    });
 
     std::cout << std::endl;
     std::cout << total_nodes << std::endl;
 }
 
+void runPerftAndPrint(Position& pos, int depth, uint64_t path) {
+    if (depth == 0) {
+        std::cout << "\n1" << std::endl;
+        return;
+    }
+
+    if (pos.sideToMove == Color::White) {
+        runDivide<Color::White>(pos, depth, path);
+    } else {
+        runDivide<Color::Black>(pos, depth, path);
+    }
+}
+
+// Plays the moves passed by the debugger (UCI notation) on top of the base position.
+void applyUciMoves(Position& pos, const std::vector<std::string>& moves_vec) {
+    for (const std::string& move_uci : moves_vec) {
+        Moves legal_moves;
+        if (pos.sideToMove == Color::White) {
+            legal_moves = pos.generateLegalMoves<Color::White>();
+        } else {
+            legal_moves = pos.generateLegalMoves<Color::Black>();
+        }
+        for (int i = 0; i < legal_moves.count; i++) {
+            Move move = legal_moves.moves[i];
+            if (move.toUci() == move_uci) {
+                if (pos.sideToMove == Color::White) {
+                    pos.makemove<Color::White>(move);
+                } else {
+                    pos.makemove<Color::Black>(move);
+                }
+                break;
+            }
+        }
+    }
+}
+
+
+// =============================================================================
+// ============================== PERSISTENT MODE ==============================
+// =============================================================================
+// Started without arguments (perftdebugger --persistent), the engine stays alive and
+// reads queries from stdin, so attack tables are only built once per session:
+//
+//   isready                                -> readyok
+//   position fen <fen> [moves <m1> <m2>..]
+//   go perft <depth>                       -> the usual divide output, then "done"
+//   quit
+void runPersistentLoop() {
+    Position pos;
+    uint64_t path = PATH_HASH_BASIS;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::stringstream ss(line);
+        std::string command;
+        ss >> command;
+
+        if (command == "isready") {
+            std::cout << "readyok" << std::endl;
+        } else if (command == "position") {
+            std::string token, fen;
+            ss >> token; // "fen"
+            while (ss >> token && token != "moves") {
+                fen += (fen.empty() ? "" : " ") + token;
+            }
+            std::vector<std::string> moves_vec;
+            while (ss >> token) {
+                moves_vec.push_back(token);
+            }
+            pos = Position();
+            pos.parseFEN(fen);
+            applyUciMoves(pos, moves_vec);
+            path = movesPathHash(moves_vec);
+        } else if (command == "go") {
+            std::string mode;
+            int depth = 0;
+            ss >> mode >> depth;
+            runPerftAndPrint(pos, depth, path);
+            perftTT.reportAndReset();
+            std::cout << "done" << std::endl;
+        } else if (command == "quit") {
+            break;
+        }
+    }
+}
+
+
+// =============================================================================
+// ============================== PLUGIN INTERFACE =============================
+// =============================================================================
+// Built as a shared library, the engine runs inside the debugger with no process or
+// pipe per query (perftdebugger ./libMyChessEngine.so):
+//
+//   g++ -O3 -std=c++17 -shared -fPIC <engine sources> -o libMyChessEngine.so
+//
+// Compile main() out of the library build, or leave it in; the debugger only looks
+// up the two functions below.
+#ifdef _WIN32
+#define PERFT_PLUGIN_EXPORT extern "C" __declspec(dllexport)
+#else
+#define PERFT_PLUGIN_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+PERFT_PLUGIN_EXPORT int perft_plugin_init() {
+    initPerftTT();
+    initPerftKernel();
+    return 0;
+}
+
+template <typename Report>
+uint64_t pluginDivide(const char* fen, const char* moves, int depth, bool checksum, Report&& report) {
+    Position pos;
+    pos.parseFEN(fen);
+
+    std::vector<std::string> moves_vec;
+    std::stringstream ss(moves);
+    std::string move_str;
+    while (ss >> move_str) {
+        moves_vec.push_back(move_str);
+    }
+    applyUciMoves(pos, moves_vec);
+
+    if (depth == 0) {
+        return 1;
+    }
+
+    uint64_t path = movesPathHash(moves_vec);
+    uint64_t total_nodes = pos.sideToMove == Color::White ? divide<Color::White>(pos, depth, path, checksum, report)
+                                                          : divide<Color::Black>(pos, depth, path, checksum, report);
+    perftTT.reportAndReset();
+    return total_nodes;
+}
+
+// moves is space-separated UCI. on_move is called for every root move and returns
+// nonzero when the debugger wants no more of them. Returns the total node count.
+PERFT_PLUGIN_EXPORT long long perft_plugin_divide(const char* fen, const char* moves, int depth,
+                                                  int (*on_move)(void* context, const char* move, long long nodes),
+                                                  void* context) {
+    auto report = [&](Move move, uint64_t nodes, const PerftDetails&) {
+        return on_move(context, move.toUci().c_str(), static_cast<long long>(nodes)) == 0;
+    };
+    return static_cast<long long>(pluginDivide(fen, moves, depth, false, report));
+}
+
+// The same, with each root move's checksum perft hash (perftdebugger --checksum).
+PERFT_PLUGIN_EXPORT long long perft_plugin_divide_checksum(
+    const char* fen, const char* moves, int depth,
+    int (*on_move)(void* context, const char* move, long long nodes, unsigned long long checksum), void* context) {
+    auto report = [&](Move move, uint64_t nodes, const PerftDetails& details) {
+        return on_move(context, move.toUci().c_str(), static_cast<long long>(nodes), details.checksum) == 0;
+    };
+    return static_cast<long long>(pluginDivide(fen, moves, depth, true, report));
+}
+
 
 // =============================================================================
 // =============================== MAIN FUNCTION ===============================
 // =============================================================================
 int main(int argc, char* argv[]) {
+    initPerftTT();
+    initPerftKernel();
+    initPerftChecksum();
+    initPerftBreakdown();
+
+    if (argc == 1) {
+        runPersistentLoop();
+        return 0;
+    }
     if (argc < 3) {
         std::cerr << "Usage: ./MyChessEngine <depth> <fen> [moves]" << std::endl;
         return 1;
@@ -118,28 +568,11 @@ int main(int argc, char* argv[]) {
     pos.parseFEN(fen);
 
     // Make the initial moves passed by the debugger
-    for (const std::string& move_uci : moves_vec) {
-        Moves legal_moves;
-        if (pos.sideToMove == Color::White) {
-            legal_moves = pos.generateLegalMoves<Color::White>();
-        } else {
-            legal_moves = pos.generateLegalMoves<Color::Black>();
-        }
-        for (int i = 0; i < legal_moves.count; i++) {
-            Move move = legal_moves.moves[i];
-            if (move.toUci() == move_uci) {
-                if (pos.sideToMove == Color::White) {
-                    pos.makemove<Color::White>(move);
-                } else {
-                    pos.makemove<Color::Black>(move);
-                }
-                break;
-            }
-        }
-    }
+    applyUciMoves(pos, moves_vec);
 
     // --- Run and Print Perft ---
-    runPerftAndPrint(pos, depth);
+    runPerftAndPrint(pos, depth, movesPathHash(moves_vec));
+    perftTT.reportAndReset();
 
     // --- THE FIX ---
     // Force all the output above to be sent to the debugger before we exit.
@@ -3,11 +3,41 @@
 #include <vector>
 #include <sstream>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <optional>
 #include <iomanip>
 #include <algorithm>
+#include <array>
 #include <stdexcept>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <tuple>
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 // platform-specific includes for process management
 #ifdef _WIN32
@@ -17,7 +47,14 @@
 #else
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #define IS_TTY isatty(fileno(stdout))
 #endif
 
@@ -32,19 +69,87 @@ namespace Color {
 // =================================================================================
 // ==================== A simple cross-platform subprocess manager==================
 // =================================================================================
+
+// Resources used by a child process: from rusage once it has exited, or sampled
+// while it runs where the platform allows it.
+struct ProcessUsage {
+    double cpu_seconds = -1; // user + system, negative if unknown
+    long peak_rss_kb = -1;   // highest over the process's life so far, negative if unknown
+};
+
 class Subprocess {
 private:
 #ifdef _WIN32
     PROCESS_INFORMATION processInfo_{};
     HANDLE childStdIn_ = NULL;
     HANDLE childStdOut_ = NULL;
-    std::string read_buffer_;
 #else
     pid_t pid_ = -1;
     FILE* childStdIn_ = nullptr;
-    FILE* childStdOut_ = nullptr;
+    int childStdOut_ = -1;
 #endif
     bool is_running_ = false;
+    ProcessUsage exit_usage_;
+    std::string exit_failure_;
+    double read_wait_seconds_ = 0;
+
+    // Output is read in large chunks and lines are handed out as views into this
+    // buffer, so reading a line neither allocates nor copies.
+    std::vector<char> read_buffer_ = std::vector<char>(64 * 1024);
+    size_t read_begin_ = 0;
+    size_t read_end_ = 0;
+
+    // Appends whatever the child has written to the buffer. Returns false on EOF.
+    bool fill_buffer() {
+        if (read_begin_ > 0) {
+            std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+            read_end_ -= read_begin_;
+            read_begin_ = 0;
+        }
+        if (read_end_ == read_buffer_.size()) read_buffer_.resize(read_buffer_.size() * 2);
+        char* dest = read_buffer_.data() + read_end_;
+        size_t capacity = read_buffer_.size() - read_end_;
+        auto start = std::chrono::steady_clock::now();
+#ifdef _WIN32
+        DWORD bytesRead = 0;
+        BOOL ok = ReadFile(childStdOut_, dest, static_cast<DWORD>(capacity), &bytesRead, NULL);
+        read_wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ok || bytesRead == 0) return false;
+        read_end_ += bytesRead;
+#else
+        ssize_t bytesRead;
+        do {
+            bytesRead = ::read(childStdOut_, dest, capacity);
+        } while (bytesRead < 0 && errno == EINTR);
+        read_wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (bytesRead <= 0) return false;
+        read_end_ += static_cast<size_t>(bytesRead);
+#endif
+        return true;
+    }
+
+    // Waits until the child has output to read, or has closed its end. Returns false
+    // if the deadline passes first.
+    bool wait_readable(std::chrono::steady_clock::time_point deadline) {
+#ifdef _WIN32
+        while (true) {
+            DWORD available = 0;
+            // A failed peek means a closed pipe, which the next read reports.
+            if (!PeekNamedPipe(childStdOut_, NULL, 0, NULL, &available, NULL) || available > 0) return true;
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            Sleep(10);
+        }
+#else
+        while (true) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            pollfd fd{childStdOut_, POLLIN, 0};
+            int ready = poll(&fd, 1, static_cast<int>(std::max<long long>(0, remaining.count())));
+            if (ready > 0) return true;
+            if (ready == 0) return false;
+            if (errno != EINTR) return true; // the next read reports the error
+        }
+#endif
+    }
 
 public:
     Subprocess(const std::string& command, const std::vector<std::string>& args) {
@@ -91,11 +196,29 @@ public:
         childStdIn_ = hChildStd_IN_Wr;
         childStdOut_ = hChildStd_OUT_Rd;
 #else
+        // Build argv before forking: only async-signal-safe calls are allowed in the
+        // child once other threads exist.
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(command.c_str()));
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        // Engines may be spawned from several threads at once. Mark our pipe ends
+        // close-on-exec under a lock so no sibling process inherits them, otherwise a
+        // reader would never see EOF while that sibling is alive.
+        static std::mutex spawn_mutex;
+        std::lock_guard<std::mutex> lock(spawn_mutex);
+
         int stdin_pipe[2];
         int stdout_pipe[2];
         if (pipe(stdin_pipe) != 0 || pipe(stdout_pipe) != 0) {
             throw std::runtime_error("pipe() failed");
         }
+        for (int fd : {stdin_pipe[0], stdin_pipe[1], stdout_pipe[0], stdout_pipe[1]}) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
 
         pid_ = fork();
         if (pid_ < 0) {
@@ -103,19 +226,8 @@ public:
         }
 
         if (pid_ == 0) { // Child process
-            close(stdin_pipe[1]);
-            close(stdout_pipe[0]);
             dup2(stdin_pipe[0], STDIN_FILENO);
             dup2(stdout_pipe[1], STDOUT_FILENO);
-            close(stdin_pipe[0]);
-            close(stdout_pipe[1]);
-
-            std::vector<char*> argv;
-            argv.push_back(const_cast<char*>(command.c_str()));
-            for (const auto& arg : args) {
-                argv.push_back(const_cast<char*>(arg.c_str()));
-            }
-            argv.push_back(nullptr);
             execvp(argv[0], argv.data());
             _exit(127); // execvp only returns on error
         }
@@ -124,8 +236,8 @@ public:
         close(stdin_pipe[0]);
         close(stdout_pipe[1]);
         childStdIn_ = fdopen(stdin_pipe[1], "w");
-        childStdOut_ = fdopen(stdout_pipe[0], "r");
-        if (!childStdIn_ || !childStdOut_) {
+        childStdOut_ = stdout_pipe[0];
+        if (!childStdIn_) {
              throw std::runtime_error("fdopen() failed");
         }
 #endif
@@ -133,20 +245,22 @@ public:
     }
 
     ~Subprocess() {
-        if (is_running_) {
 #ifdef _WIN32
+        if (is_running_) {
             TerminateProcess(processInfo_.hProcess, 1);
             CloseHandle(processInfo_.hProcess);
             CloseHandle(processInfo_.hThread);
-            CloseHandle(childStdIn_);
-            CloseHandle(childStdOut_);
+        }
+        CloseHandle(childStdIn_);
+        CloseHandle(childStdOut_);
 #else
+        if (is_running_) {
             kill(pid_, SIGKILL);
             waitpid(pid_, nullptr, 0);
-            if(childStdIn_) fclose(childStdIn_);
-            if(childStdOut_) fclose(childStdOut_);
-#endif
         }
+        if(childStdIn_) fclose(childStdIn_);
+        if(childStdOut_ >= 0) close(childStdOut_);
+#endif
     }
 
     void write(const std::string& data) {
@@ -161,306 +275,4340 @@ public:
 #endif
     }
     
-    bool read_line(std::string& line) {
-#ifdef _WIN32
-        size_t newline_pos = read_buffer_.find('\n');
-        while (newline_pos == std::string::npos) {
-            char buffer[4096];
-            DWORD bytesRead = 0;
-            if (!ReadFile(childStdOut_, buffer, sizeof(buffer), &bytesRead, NULL) || bytesRead == 0) {
-                if (!read_buffer_.empty()) { 
-                    line = read_buffer_;
-                    read_buffer_.clear();
-                    return true;
-                }
-                return false;
+    // The view stays valid until the next read.
+    bool read_line(std::string_view& line) {
+        size_t scanned = read_begin_;
+        while (true) {
+            const char* start = read_buffer_.data() + read_begin_;
+            const char* newline = static_cast<const char*>(std::memchr(read_buffer_.data() + scanned, '\n', read_end_ - scanned));
+            if (newline) {
+                line = std::string_view(start, static_cast<size_t>(newline - start));
+                read_begin_ = static_cast<size_t>(newline - read_buffer_.data()) + 1;
+                break;
             }
-            read_buffer_.append(buffer, bytesRead);
-            newline_pos = read_buffer_.find('\n');
-        }
-        line = read_buffer_.substr(0, newline_pos);
-        read_buffer_.erase(0, newline_pos + 1);
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+            scanned = read_end_ - read_begin_; // offset survives the compaction in fill_buffer
+            if (!fill_buffer()) {
+                if (read_begin_ == read_end_) return false;
+                line = std::string_view(read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+                read_begin_ = read_end_;
+                break;
+            }
+            scanned += read_begin_;
         }
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
         return true;
-#else
-        char* buf = nullptr;
-        size_t len = 0;
-        ssize_t read = getline(&buf, &len, childStdOut_);
-        if (read != -1) {
-            line = std::string(buf);
-            if (!line.empty() && line.back() == '\n') {
-                line.pop_back();
-            }
-            free(buf);
-            return true;
+    }
+
+    bool read_line(std::string& line) {
+        std::string_view view;
+        if (!read_line(view)) return false;
+        line.assign(view.data(), view.size());
+        return true;
+    }
+
+    // As above, but returns false if no complete line has arrived by the deadline.
+    bool read_line(std::string& line, std::chrono::steady_clock::time_point deadline) {
+        while (!std::memchr(read_buffer_.data() + read_begin_, '\n', read_end_ - read_begin_)) {
+            if (!wait_readable(deadline)) return false;
+            if (!fill_buffer()) break; // end of output: the last line has no newline
         }
-        if (buf) free(buf);
-        return false;
-#endif
+        return read_line(line);
     }
 
-    void wait() {
-        if (!is_running_) return;
+    // Waits for the child to exit. Returns how it failed, e.g. "killed by signal 11
+    // (Segmentation fault)" or "exited with status 3", or an empty string after a
+    // normal exit with status 0.
+    std::string wait() {
+        if (!is_running_) return exit_failure_;
 #ifdef _WIN32
         WaitForSingleObject(processInfo_.hProcess, INFINITE);
+        exit_usage_ = usage();
+        DWORD code = 0;
+        if (GetExitCodeProcess(processInfo_.hProcess, &code) && code != 0) {
+            exit_failure_ = "exited with status " + std::to_string(code);
+        }
         CloseHandle(processInfo_.hProcess);
         CloseHandle(processInfo_.hThread);
 #else
-        waitpid(pid_, nullptr, 0);
+        struct rusage usage {};
+        int status = 0;
+        if (wait4(pid_, &status, 0, &usage) == pid_) {
+            if (WIFSIGNALED(status)) {
+                exit_failure_ = "killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+            } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+                exit_failure_ = "exited with status " + std::to_string(WEXITSTATUS(status));
+            }
+            exit_usage_.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                                      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+            exit_usage_.peak_rss_kb = static_cast<long>(usage.ru_maxrss / 1024); // bytes on macOS
+#else
+            exit_usage_.peak_rss_kb = static_cast<long>(usage.ru_maxrss);
+#endif
+        }
 #endif
         is_running_ = false;
+        return exit_failure_;
+    }
+
+    // Total time spent blocked reading the child's output.
+    double read_wait_seconds() const { return read_wait_seconds_; }
+
+    // Usage so far for a running child (Windows and Linux only), or the final usage
+    // after wait().
+    ProcessUsage usage() const {
+        if (!is_running_) return exit_usage_;
+        ProcessUsage current;
+#ifdef _WIN32
+        FILETIME created, exited, kernel, user;
+        if (GetProcessTimes(processInfo_.hProcess, &created, &exited, &kernel, &user)) {
+            auto ticks = [](const FILETIME& t) { return (static_cast<unsigned long long>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+            current.cpu_seconds = (ticks(kernel) + ticks(user)) / 1e7;
+        }
+#elif defined(__linux__)
+        std::ifstream stat("/proc/" + std::to_string(pid_) + "/stat");
+        std::string text;
+        std::getline(stat, text);
+        size_t comm_end = text.rfind(')'); // the command name may contain spaces
+        if (comm_end != std::string::npos) {
+            std::stringstream fields(text.substr(comm_end + 2));
+            std::string field;
+            unsigned long long user_ticks = 0, system_ticks = 0;
+            for (int i = 0; i < 11 && fields >> field; ++i) {}
+            if (fields >> user_ticks >> system_ticks) {
+                current.cpu_seconds = static_cast<double>(user_ticks + system_ticks) / sysconf(_SC_CLK_TCK);
+            }
+        }
+        std::ifstream status("/proc/" + std::to_string(pid_) + "/status");
+        while (std::getline(status, text)) {
+            if (text.rfind("VmHWM:", 0) == 0) current.peak_rss_kb = std::atol(text.c_str() + 6);
+        }
+#endif
+        return current;
     }
 };
 
 // =================================================================================
-// ============================ Perft and Engine Logic =============================
+// ================================== Board Model ==================================
 // =================================================================================
 
-struct PerftResult {
-    long long total_nodes = 0;
-    std::map<std::string, long long> move_nodes;
-};
+using Bitboard = uint64_t;
 
-class Engine {
-public:
-    virtual ~Engine() = default;
-    virtual PerftResult run_perft(const std::string& fen, const std::vector<std::string>& moves, int depth) = 0;
+enum PieceType { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING, PIECE_TYPE_NB };
+enum Side { WHITE, BLACK };
+enum CastlingRight { WHITE_OO = 1, WHITE_OOO = 2, BLACK_OO = 4, BLACK_OOO = 8 };
+
+constexpr int NO_SQUARE = -1;
+constexpr int NO_PIECE = -1;
+
+inline Bitboard square_bb(int sq) { return 1ULL << sq; }
+inline int make_piece(int side, int type) { return side * PIECE_TYPE_NB + type; }
+inline int piece_side(int piece) { return piece / PIECE_TYPE_NB; }
+inline int piece_type(int piece) { return piece % PIECE_TYPE_NB; }
+
+inline std::string square_name(int sq) {
+    return std::string{static_cast<char>('a' + sq % 8), static_cast<char>('1' + sq / 8)};
+}
+
+inline int parse_square(std::string_view s, size_t pos = 0) {
+    if (s.size() < pos + 2) return NO_SQUARE;
+    char f = s[pos], r = s[pos + 1];
+    if (f < 'a' || f > 'h' || r < '1' || r > '8') return NO_SQUARE;
+    return (r - '1') * 8 + (f - 'a');
+}
+
+inline int popcount(Bitboard b) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(b));
+#else
+    return __builtin_popcountll(b);
+#endif
+}
+
+inline int lsb(Bitboard b) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, b);
+    return static_cast<int>(idx);
+#else
+    return __builtin_ctzll(b);
+#endif
+}
+
+inline int msb(Bitboard b) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx, b);
+    return static_cast<int>(idx);
+#else
+    return 63 - __builtin_clzll(b);
+#endif
+}
+
+inline int pop_lsb(Bitboard& b) {
+    int sq = lsb(b);
+    b &= b - 1;
+    return sq;
+}
+
+// Moves are packed into 16 bits: from-square, to-square and promotion piece
+// (0 = none, otherwise KNIGHT..QUEEN), most significant first, so sorting codes
+// sorts moves by from-square, then to-square, then promotion.
+using Move = uint16_t;
+
+inline Move encode_move(int from, int to, int promo = 0) { return static_cast<Move>((from << 9) | (to << 3) | promo); }
+inline int move_from(Move m) { return m >> 9; }
+inline int move_to(Move m) { return (m >> 3) & 63; }
+inline int move_promo(Move m) { return m & 7; }
+
+inline std::string move_to_uci(Move m) {
+    std::string out = square_name(move_from(m)) + square_name(move_to(m));
+    if (move_promo(m)) out += "?nbrq"[move_promo(m)];
+    return out;
+}
+
+// Parses UCI notation (e2e4, e7e8q). Returns false for anything else.
+inline bool parse_uci_move(std::string_view text, Move& move) {
+    int from = parse_square(text, 0);
+    int to = parse_square(text, 2);
+    if (from == NO_SQUARE || to == NO_SQUARE || text.size() > 5) return false;
+    int promo = 0;
+    if (text.size() == 5) {
+        static const std::string_view promos = "nbrq";
+        size_t idx = promos.find(text[4]);
+        if (idx == std::string_view::npos) return false;
+        promo = KNIGHT + static_cast<int>(idx);
+    }
+    move = encode_move(from, to, promo);
+    return true;
+}
+
+struct MoveList {
+    Move moves[256];
+    int size = 0;
+    void add(Move m) { moves[size++] = m; }
 };
 
-class UserEngine : public Engine {
-private:
-    std::string path_;
-public:
-    UserEngine(std::string path) : path_(std::move(path)) {}
+// Leaper attacks, sliding rays and the squares between / on a line through two
+// squares. Built once at startup.
+struct AttackTables {
+    // Opposite directions are four apart, which the line table relies on.
+    enum Direction { NORTH, EAST, NORTH_EAST, NORTH_WEST, SOUTH, WEST, SOUTH_WEST, SOUTH_EAST };
 
-    PerftResult run_perft(const std::string& fen, const std::vector<std::string>& moves, int depth) override {
-        PerftResult result;
-        std::vector<std::string> args;
-        args.push_back(std::to_string(depth));
-        args.push_back(fen);
-        if (!moves.empty()) {
-            std::stringstream ss;
-            for (size_t i = 0; i < moves.size(); ++i) {
-                ss << moves[i] << (i == moves.size() - 1 ? "" : " ");
+    Bitboard knight[64];
+    Bitboard king[64];
+    Bitboard pawn[2][64];
+    Bitboard rays[8][64];
+    Bitboard between[64][64];
+    Bitboard line[64][64];
+
+    AttackTables() {
+        const int file_step[8] = {0, 1, 1, -1, 0, -1, -1, 1};
+        const int rank_step[8] = {1, 0, 1, 1, -1, 0, -1, -1};
+        auto on_board = [](int file, int rank) { return file >= 0 && file < 8 && rank >= 0 && rank < 8; };
+
+        for (int sq = 0; sq < 64; ++sq) {
+            int file = sq % 8, rank = sq / 8;
+            knight[sq] = king[sq] = pawn[WHITE][sq] = pawn[BLACK][sq] = 0;
+            const int knight_df[8] = {1, 2, 2, 1, -1, -2, -2, -1};
+            const int knight_dr[8] = {2, 1, -1, -2, -2, -1, 1, 2};
+            for (int i = 0; i < 8; ++i) {
+                if (on_board(file + knight_df[i], rank + knight_dr[i]))
+                    knight[sq] |= square_bb((rank + knight_dr[i]) * 8 + file + knight_df[i]);
+                if (on_board(file + file_step[i], rank + rank_step[i]))
+                    king[sq] |= square_bb((rank + rank_step[i]) * 8 + file + file_step[i]);
+            }
+            for (int df : {-1, 1}) {
+                if (on_board(file + df, rank + 1)) pawn[WHITE][sq] |= square_bb((rank + 1) * 8 + file + df);
+                if (on_board(file + df, rank - 1)) pawn[BLACK][sq] |= square_bb((rank - 1) * 8 + file + df);
+            }
+            for (int dir = 0; dir < 8; ++dir) {
+                rays[dir][sq] = 0;
+                for (int f = file + file_step[dir], r = rank + rank_step[dir]; on_board(f, r); f += file_step[dir], r += rank_step[dir])
+                    rays[dir][sq] |= square_bb(r * 8 + f);
             }
-            args.push_back(ss.str());
         }
 
-        Subprocess proc(path_, args);
-        
-        std::string line;
-        while (proc.read_line(line)) {
-            if (line.empty()) continue;
-            std::stringstream line_ss(line);
-            std::string move_str;
-            long long count;
-            if (line_ss >> move_str >> count) {
-                result.move_nodes[move_str] = count;
-            } else {
-                 try {
-                    result.total_nodes = std::stoll(line);
-                 } catch(...) { /* ignore parse error */ }
+        for (int a = 0; a < 64; ++a) {
+            for (int b = 0; b < 64; ++b) {
+                between[a][b] = line[a][b] = 0;
+                for (int dir = 0; dir < 8; ++dir) {
+                    if (rays[dir][a] & square_bb(b)) {
+                        between[a][b] = rays[dir][a] & ~rays[dir][b] & ~square_bb(b);
+                        line[a][b] = rays[dir][a] | rays[(dir + 4) % 8][a] | square_bb(a);
+                    }
+                }
             }
         }
-        proc.wait();
-        return result;
+    }
+
+    // Rays pointing towards higher squares find their first blocker with lsb, the
+    // others with msb.
+    Bitboard ray_attacks(int dir, int sq, Bitboard occ) const {
+        Bitboard attacks = rays[dir][sq];
+        Bitboard blockers = attacks & occ;
+        if (blockers) attacks ^= rays[dir][dir < SOUTH ? lsb(blockers) : msb(blockers)];
+        return attacks;
+    }
+
+    Bitboard rook(int sq, Bitboard occ) const {
+        return ray_attacks(NORTH, sq, occ) | ray_attacks(SOUTH, sq, occ) | ray_attacks(EAST, sq, occ) | ray_attacks(WEST, sq, occ);
+    }
+
+    Bitboard bishop(int sq, Bitboard occ) const {
+        return ray_attacks(NORTH_EAST, sq, occ) | ray_attacks(NORTH_WEST, sq, occ) |
+               ray_attacks(SOUTH_EAST, sq, occ) | ray_attacks(SOUTH_WEST, sq, occ);
     }
 };
 
-class Stockfish : public Engine {
-private:
-    std::unique_ptr<Subprocess> process_;
-public:
-    Stockfish() {
-        try {
-            process_ = std::make_unique<Subprocess>("stockfish", std::vector<std::string>{});
-        } catch (const std::exception& e) {
-            throw std::runtime_error("CRITICAL: Failed to start the 'stockfish' process. Is it installed and in your system's PATH?");
+const AttackTables ATTACKS;
+
+// A position with a legal move generator. It is used to play UCI moves on top of a
+// FEN, to tell when two move paths transpose, and by the built-in reference engine.
+struct Board {
+    Bitboard pieces[2][PIECE_TYPE_NB] = {};
+    Bitboard occupied[2] = {};
+    int8_t mailbox[64];
+    int side = WHITE;
+    int castling = 0;
+    int ep_square = NO_SQUARE;
+    int halfmove = 0;
+    int fullmove = 1;
+
+    Board() { std::fill(std::begin(mailbox), std::end(mailbox), NO_PIECE); }
+
+    Bitboard all() const { return occupied[WHITE] | occupied[BLACK]; }
+
+    void put_piece(int piece, int sq) {
+        pieces[piece_side(piece)][piece_type(piece)] |= square_bb(sq);
+        occupied[piece_side(piece)] |= square_bb(sq);
+        mailbox[sq] = static_cast<int8_t>(piece);
+    }
+
+    void remove_piece(int sq) {
+        int piece = mailbox[sq];
+        if (piece == NO_PIECE) return;
+        pieces[piece_side(piece)][piece_type(piece)] &= ~square_bb(sq);
+        occupied[piece_side(piece)] &= ~square_bb(sq);
+        mailbox[sq] = NO_PIECE;
+    }
+
+    // Returns false on malformed input, leaving the board in an unspecified state.
+    bool parse_fen(const std::string& fen) {
+        *this = Board();
+        std::stringstream ss(fen);
+        std::string placement, side_str, castling_str = "-", ep_str = "-";
+        if (!(ss >> placement >> side_str)) return false;
+        ss >> castling_str >> ep_str;
+        int halfmove_in = 0, fullmove_in = 1;
+        if (ss >> halfmove_in >> fullmove_in) {
+            halfmove = halfmove_in;
+            fullmove = fullmove_in;
         }
-        
-        process_->write("uci\n");
-        std::string line;
-        bool uciok_received = false;
-        // Basic timeout mechanism
-        for(int i=0; i < 50; ++i) { // Try reading up to 50 lines
-            if(process_->read_line(line) && line.find("uciok") != std::string::npos) {
-                uciok_received = true;
-                break;
+
+        int rank = 7, file = 0;
+        for (char c : placement) {
+            if (c == '/') {
+                if (file != 8 || rank == 0) return false;
+                --rank;
+                file = 0;
+            } else if (c >= '1' && c <= '8') {
+                file += c - '0';
+                if (file > 8) return false;
+            } else {
+                static const std::string symbols = "PNBRQKpnbrqk";
+                size_t idx = symbols.find(c);
+                if (idx == std::string::npos || file > 7) return false;
+                put_piece(static_cast<int>(idx), rank * 8 + file);
+                ++file;
             }
         }
-        if (!uciok_received) {
-            throw std::runtime_error("CRITICAL: Did not receive 'uciok' confirmation from Stockfish. The engine may have failed to start correctly.");
+        if (rank != 0 || file != 8) return false;
+
+        if (side_str == "w") side = WHITE;
+        else if (side_str == "b") side = BLACK;
+        else return false;
+
+        for (char c : castling_str) {
+            if (c == 'K') castling |= WHITE_OO;
+            else if (c == 'Q') castling |= WHITE_OOO;
+            else if (c == 'k') castling |= BLACK_OO;
+            else if (c == 'q') castling |= BLACK_OOO;
+            else if (c != '-') return false;
         }
-    }
 
-    PerftResult run_perft(const std::string& fen, const std::vector<std::string>& moves, int depth) override {
-        PerftResult result;
-        std::stringstream cmd;
-        cmd << "position fen " << fen;
-        if (!moves.empty()) {
-            cmd << " moves";
-            for (const auto& move : moves) cmd << " " << move;
+        if (ep_str != "-") {
+            ep_square = parse_square(ep_str);
+            if (ep_square == NO_SQUARE) return false;
         }
-        cmd << "\n";
-        cmd << "go perft " << depth << "\n";
-        process_->write(cmd.str());
-        
-        std::string line;
-        while (process_->read_line(line)) {
-            if (line.find("Nodes searched:") != std::string::npos) {
-                result.total_nodes = std::stoll(line.substr(line.find(":") + 1));
-                break;
-            }
-            std::stringstream ss(line);
-            std::string move_str, count_str;
-            if(ss >> move_str >> count_str && !move_str.empty() && move_str.back() == ':') {
-                 move_str.pop_back();
-                 result.move_nodes[move_str] = std::stoll(count_str);
+        return true;
+    }
+
+    std::string fen() const {
+        static const char symbols[] = "PNBRQKpnbrqk";
+        std::string out;
+        for (int rank = 7; rank >= 0; --rank) {
+            int empty = 0;
+            for (int file = 0; file < 8; ++file) {
+                int piece = mailbox[rank * 8 + file];
+                if (piece == NO_PIECE) { ++empty; continue; }
+                if (empty) { out += static_cast<char>('0' + empty); empty = 0; }
+                out += symbols[piece];
             }
+            if (empty) out += static_cast<char>('0' + empty);
+            if (rank) out += '/';
         }
-        return result;
+        out += side == WHITE ? " w " : " b ";
+        std::string rights;
+        if (castling & WHITE_OO) rights += 'K';
+        if (castling & WHITE_OOO) rights += 'Q';
+        if (castling & BLACK_OO) rights += 'k';
+        if (castling & BLACK_OOO) rights += 'q';
+        out += rights.empty() ? "-" : rights;
+        out += " " + (ep_square == NO_SQUARE ? std::string("-") : square_name(ep_square));
+        out += " " + std::to_string(halfmove) + " " + std::to_string(fullmove);
+        return out;
     }
-};
 
-// =================================================================================
-// =========================== Diff and State Management ===========================
-// =================================================================================
+    // Plays a move without checking that it is legal. Castling is a king move of two
+    // squares, en passant a pawn move onto the en-passant square.
+    void make_move(Move m) {
+        int from = move_from(m), to = move_to(m);
+        int piece = mailbox[from];
+        int type = piece_type(piece);
+        int us = piece_side(piece);
+        bool capture = mailbox[to] != NO_PIECE;
 
-struct DiffResult {
-    std::pair<long long, long long> total_nodes;
-    std::map<std::string, std::pair<std::optional<long long>, std::optional<long long>>> move_nodes;
+        if (type == PAWN && to == ep_square && !capture) {
+            remove_piece(us == WHITE ? to - 8 : to + 8);
+            capture = true;
+        }
+        remove_piece(to);
+        remove_piece(from);
+        put_piece(move_promo(m) ? make_piece(us, move_promo(m)) : piece, to);
+
+        if (type == KING && (to - from == 2 || from - to == 2)) {
+            int rook_from = to > from ? to + 1 : to - 2;
+            int rook_to = to > from ? to - 1 : to + 1;
+            int rook = mailbox[rook_from];
+            remove_piece(rook_from);
+            if (rook != NO_PIECE) put_piece(rook, rook_to);
+        }
+
+        static const struct CastlingMask {
+            int mask[64];
+            CastlingMask() {
+                std::fill(std::begin(mask), std::end(mask), WHITE_OO | WHITE_OOO | BLACK_OO | BLACK_OOO);
+                mask[4] &= ~(WHITE_OO | WHITE_OOO);
+                mask[7] &= ~WHITE_OO;
+                mask[0] &= ~WHITE_OOO;
+                mask[60] &= ~(BLACK_OO | BLACK_OOO);
+                mask[63] &= ~BLACK_OO;
+                mask[56] &= ~BLACK_OOO;
+            }
+        } castling_masks;
+        castling &= castling_masks.mask[from] & castling_masks.mask[to];
 
-    DiffResult(const PerftResult& user_result, const PerftResult& stockfish_result) {
-        total_nodes = {user_result.total_nodes, stockfish_result.total_nodes};
-        for (const auto& pair : user_result.move_nodes) move_nodes[pair.first].first = pair.second;
-        for (const auto& pair : stockfish_result.move_nodes) move_nodes[pair.first].second = pair.second;
+        ep_square = (type == PAWN && (to - from == 16 || from - to == 16)) ? (from + to) / 2 : NO_SQUARE;
+        halfmove = (type == PAWN || capture) ? 0 : halfmove + 1;
+        if (side == BLACK) ++fullmove;
+        side ^= 1;
     }
-};
 
-void print_diff(const DiffResult& diff) {
-    size_t max_node_width = 0;
-    for (const auto& pair : diff.move_nodes) {
-        if (pair.second.first.has_value()) {
-            max_node_width = std::max(max_node_width, std::to_string(pair.second.first.value()).length());
-        }
-        if (pair.second.second.has_value()) {
-            max_node_width = std::max(max_node_width, std::to_string(pair.second.second.value()).length());
-        }
+    // Plays a move in UCI notation (e2e4, e7e8q, e1g1). Returns false if the string is
+    // malformed or there is no piece on the from-square.
+    bool apply_uci(const std::string& move) {
+        Move m;
+        if (!parse_uci_move(move, m) || mailbox[move_from(m)] == NO_PIECE) return false;
+        make_move(m);
+        return true;
     }
-    max_node_width = std::max(max_node_width, (size_t)10);
 
-    std::cout << std::left << std::setw(8) << "Move"
-              << std::right << std::setw(max_node_width) << "YourEngine"
-              << std::right << std::setw(max_node_width + 1) << "Stockfish" << std::endl;
-    std::cout << std::left << std::setw(8) << "--------"
-              << std::right << std::setw(max_node_width) << "----------"
-              << std::right << std::setw(max_node_width + 1) << "----------" << std::endl;
+    // Like apply_uci, but only accepts moves that are legal in this position.
+    bool apply_legal_uci(const std::string& move) {
+        Move m;
+        if (!parse_uci_move(move, m)) return false;
+        MoveList list;
+        generate_legal(list);
+        if (std::find(list.moves, list.moves + list.size, m) == list.moves + list.size) return false;
+        make_move(m);
+        return true;
+    }
 
-    for (const auto& pair : diff.move_nodes) {
-        long long lhs = pair.second.first.value_or(0);
-        long long rhs = pair.second.second.value_or(0);
-        
-        bool missing_in_user = !pair.second.first.has_value();
-        bool missing_in_stockfish = !pair.second.second.has_value();
-        bool counts_differ = !missing_in_user && !missing_in_stockfish && lhs != rhs;
+    Bitboard attackers_to(int sq, Bitboard occ) const {
+        return (ATTACKS.pawn[WHITE][sq] & pieces[BLACK][PAWN]) |
+               (ATTACKS.pawn[BLACK][sq] & pieces[WHITE][PAWN]) |
+               (ATTACKS.knight[sq] & (pieces[WHITE][KNIGHT] | pieces[BLACK][KNIGHT])) |
+               (ATTACKS.king[sq] & (pieces[WHITE][KING] | pieces[BLACK][KING])) |
+               (ATTACKS.rook(sq, occ) & (pieces[WHITE][ROOK] | pieces[BLACK][ROOK] | pieces[WHITE][QUEEN] | pieces[BLACK][QUEEN])) |
+               (ATTACKS.bishop(sq, occ) & (pieces[WHITE][BISHOP] | pieces[BLACK][BISHOP] | pieces[WHITE][QUEEN] | pieces[BLACK][QUEEN]));
+    }
+
+    int king_square(int s) const { return pieces[s][KING] ? lsb(pieces[s][KING]) : NO_SQUARE; }
 
-        if (missing_in_user) std::cout << Color::PINK;
-        else if (missing_in_stockfish) std::cout << Color::CYAN;
-        else if (counts_differ) std::cout << Color::ORANGE;
+    Bitboard checkers() const {
+        int ksq = king_square(side);
+        return ksq == NO_SQUARE ? 0 : attackers_to(ksq, all()) & occupied[side ^ 1];
+    }
 
-        std::cout << std::left << std::setw(8) << pair.first;
+    // Generates strictly legal moves using check and pin masks, so no move has to be
+    // made and tested afterwards.
+    void generate_legal(MoveList& list) const {
+        const int us = side, them = side ^ 1;
+        const Bitboard occ = all();
+        const Bitboard own = occupied[us], enemy = occupied[them];
+        const int ksq = king_square(us);
+        if (ksq == NO_SQUARE) return;
 
-        if (missing_in_user) {
-            std::cout << std::right << std::setw(max_node_width) << "-";
-        } else {
-            std::cout << std::right << std::setw(max_node_width) << lhs;
+        const Bitboard check = attackers_to(ksq, occ) & enemy;
+        const Bitboard occ_without_king = occ ^ square_bb(ksq);
+        for (Bitboard b = ATTACKS.king[ksq] & ~own; b; ) {
+            int to = pop_lsb(b);
+            if (!(attackers_to(to, occ_without_king) & enemy)) list.add(encode_move(ksq, to));
         }
+        if (popcount(check) > 1) return;
 
-        if (missing_in_stockfish) {
-            std::cout << std::right << std::setw(max_node_width + 1) << "-";
-        } else {
-            std::cout << std::right << std::setw(max_node_width + 1) << rhs;
+        const Bitboard target = check ? (ATTACKS.between[ksq][lsb(check)] | check) : ~0ULL;
+
+        Bitboard pinned = 0;
+        Bitboard snipers = (ATTACKS.rook(ksq, enemy) & (pieces[them][ROOK] | pieces[them][QUEEN])) |
+                           (ATTACKS.bishop(ksq, enemy) & (pieces[them][BISHOP] | pieces[them][QUEEN]));
+        while (snipers) {
+            Bitboard blockers = ATTACKS.between[ksq][pop_lsb(snipers)] & occ;
+            if (popcount(blockers) == 1) pinned |= blockers & own;
         }
-        
-        std::cout << std::endl;
+        auto allowed = [&](int from) { return (pinned & square_bb(from)) ? ATTACKS.line[ksq][from] : ~0ULL; };
 
-        if (missing_in_user || missing_in_stockfish || counts_differ) {
-            std::cout << Color::RESET;
+        for (Bitboard b = pieces[us][KNIGHT] & ~pinned; b; ) {
+            int from = pop_lsb(b);
+            for (Bitboard t = ATTACKS.knight[from] & ~own & target; t; ) list.add(encode_move(from, pop_lsb(t)));
+        }
+        for (Bitboard b = pieces[us][BISHOP] | pieces[us][QUEEN]; b; ) {
+            int from = pop_lsb(b);
+            for (Bitboard t = ATTACKS.bishop(from, occ) & ~own & target & allowed(from); t; ) list.add(encode_move(from, pop_lsb(t)));
+        }
+        for (Bitboard b = pieces[us][ROOK] | pieces[us][QUEEN]; b; ) {
+            int from = pop_lsb(b);
+            for (Bitboard t = ATTACKS.rook(from, occ) & ~own & target & allowed(from); t; ) list.add(encode_move(from, pop_lsb(t)));
         }
-    }
 
-    std::cout << "\n";
-    bool total_is_different = diff.total_nodes.first != diff.total_nodes.second;
-    if (total_is_different) std::cout << Color::ORANGE;
-    std::cout << "Total    " << diff.total_nodes.first << "\t" << diff.total_nodes.second << std::endl;
-    if (total_is_different) std::cout << Color::RESET;
-}
+        const int up = us == WHITE ? 8 : -8;
+        const int start_rank = us == WHITE ? 1 : 6;
+        const int last_rank = us == WHITE ? 7 : 0;
+        auto add_pawn_move = [&](int from, int to) {
+            if (to / 8 == last_rank) {
+                for (int promo = QUEEN; promo >= KNIGHT; --promo) list.add(encode_move(from, to, promo));
+            } else {
+                list.add(encode_move(from, to));
+            }
+        };
+        for (Bitboard b = pieces[us][PAWN]; b; ) {
+            int from = pop_lsb(b);
+            Bitboard mask = target & allowed(from);
+            int to = from + up;
+            if (!(occ & square_bb(to))) {
+                if (mask & square_bb(to)) add_pawn_move(from, to);
+                if (from / 8 == start_rank && !(occ & square_bb(to + up)) && (mask & square_bb(to + up)))
+                    list.add(encode_move(from, to + up));
+            }
+            for (Bitboard t = ATTACKS.pawn[us][from] & enemy & mask; t; ) add_pawn_move(from, pop_lsb(t));
 
-class State {
-private:
-    std::unique_ptr<Engine> user_engine_;
-    std::unique_ptr<Engine> stockfish_engine_;
-    std::string fen_ = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
-    std::vector<std::string> moves_;
-    int depth_ = 1;
+            // En passant can expose the king along the rank of both pawns, so it is
+            // checked by looking at the position after the capture.
+            if (ep_square != NO_SQUARE && (ATTACKS.pawn[us][from] & square_bb(ep_square))) {
+                int captured = ep_square - up;
+                Bitboard after = (occ ^ square_bb(from) ^ square_bb(captured)) | square_bb(ep_square);
+                if (!(attackers_to(ksq, after) & enemy & ~square_bb(captured)))
+                    list.add(encode_move(from, ep_square));
+            }
+        }
 
-public:
-    State(const std::string& user_engine_path) {
-        user_engine_ = std::make_unique<UserEngine>(user_engine_path);
-        stockfish_engine_ = std::make_unique<Stockfish>();
+        if (!check) {
+            auto attacked = [&](int sq) { return (attackers_to(sq, occ) & enemy) != 0; };
+            int rook = make_piece(us, ROOK);
+            int base = us == WHITE ? 0 : 56;
+            int oo = us == WHITE ? WHITE_OO : BLACK_OO;
+            int ooo = us == WHITE ? WHITE_OOO : BLACK_OOO;
+            if (ksq == base + 4) {
+                if ((castling & oo) && mailbox[base + 7] == rook && !(occ & (square_bb(base + 5) | square_bb(base + 6))) &&
+                    !attacked(base + 5) && !attacked(base + 6))
+                    list.add(encode_move(ksq, base + 6));
+                if ((castling & ooo) && mailbox[base] == rook &&
+                    !(occ & (square_bb(base + 1) | square_bb(base + 2) | square_bb(base + 3))) &&
+                    !attacked(base + 3) && !attacked(base + 2))
+                    list.add(encode_move(ksq, base + 2));
+            }
+        }
     }
 
-    void set_fen(std::string new_fen) { fen_ = std::move(new_fen); moves_.clear(); }
-    void set_depth(int d) { depth_ = d; }
-    void goto_root() { moves_.clear(); }
-    void goto_parent() { if (!moves_.empty()) moves_.pop_back(); }
-    void goto_child(const std::string& move) { moves_.push_back(move); }
+    // The same position with castling rights whose king or rook has left its square
+    // dropped, and the en passant square dropped unless a pawn can capture there.
+    Board normalised() const {
+        Board normalised = *this;
+        if (mailbox[4] != make_piece(WHITE, KING)) normalised.castling &= ~(WHITE_OO | WHITE_OOO);
+        if (mailbox[7] != make_piece(WHITE, ROOK)) normalised.castling &= ~WHITE_OO;
+        if (mailbox[0] != make_piece(WHITE, ROOK)) normalised.castling &= ~WHITE_OOO;
+        if (mailbox[60] != make_piece(BLACK, KING)) normalised.castling &= ~(BLACK_OO | BLACK_OOO);
+        if (mailbox[63] != make_piece(BLACK, ROOK)) normalised.castling &= ~BLACK_OO;
+        if (mailbox[56] != make_piece(BLACK, ROOK)) normalised.castling &= ~BLACK_OOO;
 
-    void run_diff() {
-        int current_depth = std::max(1, depth_ - static_cast<int>(moves_.size()));
-        std::cout << "\n--- Running Perft ---\n";
-        std::cout << "FEN: " << fen_ << std::endl;
-        std::cout << "Moves: ";
-        if(moves_.empty()) std::cout << "(none)";
-        else for(const auto& m : moves_) std::cout << m << " ";
-        std::cout << "\nDepth: " << current_depth << std::endl << std::endl;
+        if (ep_square != NO_SQUARE) {
+            int behind = side == WHITE ? ep_square - 8 : ep_square + 8;
+            int file = ep_square % 8;
+            int our_pawn = make_piece(side, PAWN);
+            bool capturable = behind >= 0 && behind < 64 && mailbox[behind] == make_piece(side ^ 1, PAWN) &&
+                ((file > 0 && mailbox[behind - 1] == our_pawn) || (file < 7 && mailbox[behind + 1] == our_pawn));
+            if (!capturable) normalised.ep_square = NO_SQUARE;
+        }
+        return normalised;
+    }
 
-        PerftResult user_result = user_engine_->run_perft(fen_, moves_, current_depth);
-        PerftResult stockfish_result = stockfish_engine_->run_perft(fen_, moves_, current_depth);
-        
-        DiffResult diff(user_result, stockfish_result);
-        print_diff(diff);
+    // FEN of the normalised position without move counters. Positions with equal
+    // keys have identical perft trees.
+    std::string key() const {
+        std::string full = normalised().fen();
+        return full.substr(0, full.rfind(' ', full.rfind(' ') - 1));
     }
 };
 
-void print_help() {
-    std::cout << "\n--- Perft Debugger Commands ---\n"
-              << "diff          - Run comparison at the current position.\n"
-              << "depth <N>     - Set the total perft depth.\n"
-              << "fen <FEN>     - Set the board FEN. Clears current moves.\n"
-              << "move <m>      - Make a move (e.g., move e2e4).\n"
+// =================================================================================
+// ================================== Thread Pool ==================================
+// =================================================================================
+
+// Fixed set of workers, each with its own task deque. A worker takes its newest task
+// first and, when its deque runs dry, steals the oldest task of another worker, so
+// uneven tasks (perft subtrees differ a lot in size) still keep every core busy.
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> next_queue_{0};
+    bool stop_ = false;
+
+    inline static thread_local WorkStealingPool* current_pool_ = nullptr;
+    inline static thread_local size_t current_index_ = 0;
+
+    bool pop_task(size_t self, std::function<void()>& task) {
+        {
+            std::lock_guard<std::mutex> lock(queues_[self]->mutex);
+            if (!queues_[self]->tasks.empty()) {
+                task = std::move(queues_[self]->tasks.back());
+                queues_[self]->tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& victim = *queues_[(self + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(size_t self) {
+        current_pool_ = this;
+        current_index_ = self;
+        while (true) {
+            std::function<void()> task;
+            if (pop_task(self, task)) {
+                --queued_;
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (stop_ && queued_ == 0) return;
+        }
+    }
+
+public:
+    explicit WorkStealingPool(size_t threads) {
+        threads = std::max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i) queues_.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < threads; ++i) threads_.emplace_back([this, i] { worker_loop(i); });
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) thread.join();
+    }
+
+    size_t size() const { return threads_.size(); }
+
+    // Tasks submitted from a worker go to that worker's own deque; others are spread
+    // round-robin. A task must not block on the future of another task.
+    template <typename F>
+    auto submit(F f) -> std::future<decltype(f())> {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+        std::future<R> future = task->get_future();
+        size_t target = current_pool_ == this ? current_index_ : next_queue_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+            queues_[target]->tasks.emplace_back([task] { (*task)(); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            ++queued_;
+        }
+        wake_.notify_one();
+        return future;
+    }
+};
+
+// =================================================================================
+// =============================== Query Statistics ================================
+// =================================================================================
+
+// Timing of a single engine query, split into the phases the harness controls and
+// the time spent waiting for the engine, so it is clear which side to tune.
+struct QueryStats {
+    std::string engine;
+    int depth = 0;
+    long long nodes = 0;
+    double spawn = 0;       // starting the engine process, including any handshake
+    double wait = 0;        // blocked reading output, i.e. the engine computing
+    double parse = 0;       // turning output lines into counts
+    double report = 0;      // in the caller's per-move callback (live diff printing)
+    double total = 0;       // wall time of the whole query
+    double child_cpu = -1;  // CPU time of the engine process, negative if unknown
+    long peak_rss_kb = -1;  // lifetime peak resident memory of the engine process when the query
+                            // ended: a persistent process carries its peak over from earlier queries
+
+    double nps() const { return total > 0 ? nodes / total : 0; }
+};
+
+// Adds the time from construction to destruction to `target`.
+class PhaseTimer {
+private:
+    double& target_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+public:
+    explicit PhaseTimer(double& target) : target_(target) {}
+    ~PhaseTimer() { target_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count(); }
+};
+
+std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+// Every query of the session, for the `stats` command, or the most recent ones
+// once a limit is set.
+class QueryLog {
+private:
+    std::mutex mutex_;
+    std::deque<QueryStats> queries_;
+    size_t limit_ = 0; // 0: keep every query
+
+public:
+    void add(const QueryStats& stats) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queries_.push_back(stats);
+        if (limit_ && queries_.size() > limit_) queries_.pop_front();
+    }
+
+    // A long-running server would otherwise grow the log without bound.
+    void set_limit(size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        limit_ = limit;
+        while (limit_ && queries_.size() > limit_) queries_.pop_front();
+    }
+
+    std::vector<QueryStats> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::vector<QueryStats>(queries_.begin(), queries_.end());
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queries_.clear();
+    }
+
+    // Per engine: totals of every phase, then a histogram of query wall times in
+    // decades from 1 ms to 10 s.
+    void print_summary() {
+        std::vector<QueryStats> queries = snapshot();
+        if (queries.empty()) {
+            std::cout << "No queries recorded yet." << std::endl;
+            return;
+        }
+        std::vector<std::string> engines;
+        for (const auto& q : queries) {
+            if (std::find(engines.begin(), engines.end(), q.engine) == engines.end()) engines.push_back(q.engine);
+        }
+
+        std::cout << std::left << std::setw(11) << "Engine" << std::right << std::setw(8) << "Queries"
+                  << std::setw(14) << "Nodes" << std::setw(10) << "Wall(s)" << std::setw(9) << "Spawn"
+                  << std::setw(9) << "Wait" << std::setw(9) << "Parse" << std::setw(9) << "Report"
+                  << std::setw(9) << "CPU(s)" << std::setw(9) << "Peak(MB)" << std::setw(9) << "Mnps" << std::endl;
+        std::cout << std::fixed << std::setprecision(3);
+        for (const auto& engine : engines) {
+            QueryStats sum;
+            size_t count = 0;
+            bool cpu_known = false;
+            for (const auto& q : queries) {
+                if (q.engine != engine) continue;
+                ++count;
+                sum.nodes += q.nodes;
+                sum.spawn += q.spawn;
+                sum.wait += q.wait;
+                sum.parse += q.parse;
+                sum.report += q.report;
+                sum.total += q.total;
+                if (q.child_cpu >= 0) {
+                    sum.child_cpu = (cpu_known ? sum.child_cpu : 0) + q.child_cpu;
+                    cpu_known = true;
+                }
+                sum.peak_rss_kb = std::max(sum.peak_rss_kb, q.peak_rss_kb);
+            }
+            std::cout << std::left << std::setw(11) << engine << std::right << std::setw(8) << count
+                      << std::setw(14) << sum.nodes << std::setw(10) << sum.total << std::setw(9) << sum.spawn
+                      << std::setw(9) << sum.wait << std::setw(9) << sum.parse << std::setw(9) << sum.report;
+            if (cpu_known) std::cout << std::setw(9) << sum.child_cpu;
+            else std::cout << std::setw(9) << "-";
+            if (sum.peak_rss_kb >= 0) std::cout << std::setw(9) << sum.peak_rss_kb / 1024.0;
+            else std::cout << std::setw(9) << "-";
+            if (engine == "cache" || engine == "golden") std::cout << std::setw(9) << "-" << std::endl; // lookups, not searches
+            else std::cout << std::setw(9) << sum.nps() / 1e6 << std::endl;
+        }
+        std::cout.unsetf(std::ios::floatfield);
+        std::cout << std::setprecision(6);
+
+        double wall = 0, harness = 0, waiting = 0;
+        for (const auto& q : queries) {
+            if (q.engine == "cache" || q.engine == "golden") continue;
+            wall += q.total;
+            harness += q.spawn + q.parse + q.report;
+            waiting += q.wait;
+        }
+        if (wall > 0) {
+            std::cout << "\nOf " << wall << " s in engine queries, " << std::setprecision(3) << 100 * waiting / wall
+                      << "% was spent waiting for engine output and " << 100 * harness / wall
+                      << "% in spawning, parsing and reporting." << std::setprecision(6) << std::endl;
+        }
+
+        static const char* const LABELS[] = {"  < 1ms", " < 10ms", "< 100ms", "   < 1s", "  < 10s", " >= 10s"};
+        for (const auto& engine : engines) {
+            size_t buckets[6] = {};
+            for (const auto& q : queries) {
+                if (q.engine != engine) continue;
+                int bucket = 0;
+                for (double limit = 1e-3; bucket < 5 && q.total >= limit; limit *= 10) ++bucket;
+                ++buckets[bucket];
+            }
+            size_t peak = *std::max_element(std::begin(buckets), std::end(buckets));
+            std::cout << "\nQuery times, " << engine << ":" << std::endl;
+            for (int i = 0; i < 6; ++i) {
+                std::cout << "  " << LABELS[i] << " " << std::setw(6) << buckets[i] << " "
+                          << std::string(peak ? (buckets[i] * 40 + peak - 1) / peak : 0, '#') << std::endl;
+            }
+        }
+    }
+
+    bool write_csv(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) return false;
+        out << "engine,depth,nodes,total_s,spawn_s,wait_s,parse_s,report_s,child_cpu_s,lifetime_peak_rss_kb,nps\n";
+        for (const auto& q : snapshot()) {
+            out << q.engine << ',' << q.depth << ',' << q.nodes << ',' << q.total << ',' << q.spawn << ','
+                << q.wait << ',' << q.parse << ',' << q.report << ',' << q.child_cpu << ',' << q.peak_rss_kb << ','
+                << static_cast<long long>(q.nps()) << '\n';
+        }
+        return static_cast<bool>(out);
+    }
+
+    bool write_json(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) return false;
+        std::vector<QueryStats> queries = snapshot();
+        out << "[\n";
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const QueryStats& q = queries[i];
+            out << "  {\"engine\": \"" << json_escape(q.engine) << "\", \"depth\": " << q.depth
+                << ", \"nodes\": " << q.nodes << ", \"total_s\": " << q.total << ", \"spawn_s\": " << q.spawn
+                << ", \"wait_s\": " << q.wait << ", \"parse_s\": " << q.parse << ", \"report_s\": " << q.report
+                << ", \"child_cpu_s\": " << q.child_cpu << ", \"lifetime_peak_rss_kb\": " << q.peak_rss_kb
+                << ", \"nps\": " << static_cast<long long>(q.nps()) << "}" << (i + 1 < queries.size() ? "," : "") << "\n";
+        }
+        out << "]\n";
+        return static_cast<bool>(out);
+    }
+};
+
+QueryLog QUERY_LOG;
+
+// =================================================================================
+// ============================ Perft and Engine Logic =============================
+// =================================================================================
+
+// Breakdown perft: leaf counters per root move, as in the perft tables on
+// chessprogramming.org. Among the leaves, those reached by a capture (en passant
+// included), by an en passant capture, a castle or a promotion, and those where the
+// side to move is in check or checkmated.
+enum BreakdownField { CAPTURES, EN_PASSANT, CASTLES, PROMOTIONS, CHECKS, MATES, BREAKDOWN_FIELDS };
+const char* const BREAKDOWN_NAMES[BREAKDOWN_FIELDS] = {"captures", "ep", "castles", "promotions", "checks", "mates"};
+using Breakdown = std::array<long long, BREAKDOWN_FIELDS>;
+
+struct MoveCount {
+    Move move;
+    long long nodes;
+    std::optional<uint64_t> hash;       // checksum of the subtree, if the engine reported one
+    std::optional<Breakdown> breakdown; // leaf counters, if the engine reported them
+};
+
+inline void add_breakdown(std::optional<Breakdown>& sum, const Breakdown& counters) {
+    if (!sum) sum = Breakdown{};
+    for (int i = 0; i < BREAKDOWN_FIELDS; ++i) (*sum)[i] += counters[i];
+}
+
+// Checksum perft. Two bugs in one subtree can cancel out in the node count (a missing
+// move and a bogus one), but not in a checksum of the leaves. Each leaf contributes a
+// hash of the move path reaching it from the base FEN (the query's moves, then the
+// moves below them): 64-bit FNV-1a over every move's UCI text followed by a space, put
+// through the splitmix64 finalizer. A root move's checksum is the sum of its leaves'
+// hashes modulo 2^64, so the order in which moves are generated does not matter.
+constexpr uint64_t PATH_HASH_BASIS = 14695981039346656037ull;
+
+inline uint64_t path_hash_char(uint64_t hash, char c) {
+    return (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+}
+
+inline uint64_t path_hash(uint64_t hash, std::string_view uci) {
+    for (char c : uci) hash = path_hash_char(hash, c);
+    return path_hash_char(hash, ' ');
+}
+
+// path_hash(hash, move_to_uci(move)) without building the string.
+inline uint64_t path_hash(uint64_t hash, Move move) {
+    for (int sq : {move_from(move), move_to(move)}) {
+        hash = path_hash_char(hash, static_cast<char>('a' + (sq & 7)));
+        hash = path_hash_char(hash, static_cast<char>('1' + (sq >> 3)));
+    }
+    if (move_promo(move)) hash = path_hash_char(hash, "?nbrq"[move_promo(move)]);
+    return path_hash_char(hash, ' ');
+}
+
+inline uint64_t leaf_hash(uint64_t path) {
+    path = (path ^ (path >> 30)) * 0xbf58476d1ce4e5b9ull;
+    path = (path ^ (path >> 27)) * 0x94d049bb133111ebull;
+    return path ^ (path >> 31);
+}
+
+inline std::string format_hash(uint64_t hash) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+// Root moves are kept in a flat array sorted by move code, so two results can be
+// compared with a single linear merge.
+struct PerftResult {
+    long long total_nodes = 0;
+    std::vector<MoveCount> moves;
+    bool aborted = false; // stopped early on request; moves and total are incomplete
+    std::string crash;    // how the engine failed mid-query, empty if it did not; moves and total are incomplete
+    // Root move lines whose move is no UCI move ("e2e8Q 1"), kept as text so that the
+    // diff shows them as extra moves instead of only as a wrong total.
+    std::vector<std::pair<std::string, long long>> unrecognised;
+
+    // Neither stopped nor crashed, so the answer is safe to store.
+    bool complete() const { return !aborted && crash.empty(); }
+
+    // Call after adding moves in any order. If a move was reported twice the last
+    // count wins.
+    void sort_moves() {
+        std::stable_sort(moves.begin(), moves.end(), [](const MoveCount& a, const MoveCount& b) { return a.move < b.move; });
+        auto last = moves.begin();
+        for (auto it = moves.begin(); it != moves.end(); ++it) {
+            if (last != moves.begin() && (last - 1)->move == it->move) *(last - 1) = *it;
+            else *last++ = *it;
+        }
+        moves.erase(last, moves.end());
+    }
+
+    const MoveCount* find(Move move) const {
+        auto it = std::lower_bound(moves.begin(), moves.end(), move, [](const MoveCount& a, Move m) { return a.move < m; });
+        return it != moves.end() && it->move == move ? &*it : nullptr;
+    }
+};
+
+inline bool parse_count(std::string_view text, long long& value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+inline bool parse_hash(std::string_view text, uint64_t& value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+// Reads one "key=value" detail of a root move into `entry`: hash=<hex> for checksum
+// perft, or one of the BREAKDOWN_NAMES counters. Unknown keys are skipped; returns
+// false if the token is no key=value pair or its value is malformed.
+inline bool parse_move_detail(std::string_view token, MoveCount& entry) {
+    size_t equals = token.find('=');
+    if (equals == std::string_view::npos) return false;
+    std::string_view key = token.substr(0, equals), value = token.substr(equals + 1);
+    if (key == "hash") {
+        uint64_t hash;
+        if (!parse_hash(value, hash)) return false;
+        entry.hash = hash;
+        return true;
+    }
+    for (int i = 0; i < BREAKDOWN_FIELDS; ++i) {
+        if (key != BREAKDOWN_NAMES[i]) continue;
+        long long count;
+        if (!parse_count(value, count)) return false;
+        if (!entry.breakdown) entry.breakdown = Breakdown{};
+        (*entry.breakdown)[i] = count;
+    }
+    return true;
+}
+
+// The details parse_move_detail reads, each preceded by `separator`.
+inline std::string format_move_details(const MoveCount& entry, char separator) {
+    std::string out;
+    if (entry.hash) out += separator + std::string("hash=") + format_hash(*entry.hash);
+    if (entry.breakdown) {
+        for (int i = 0; i < BREAKDOWN_FIELDS; ++i) {
+            out += separator + std::string(BREAKDOWN_NAMES[i]) + "=" + std::to_string((*entry.breakdown)[i]);
+        }
+    }
+    return out;
+}
+
+inline std::string_view next_token(std::string_view& text) {
+    size_t start = text.find_first_not_of(" \t");
+    if (start == std::string_view::npos) {
+        text = {};
+        return {};
+    }
+    size_t end = text.find_first_of(" \t", start);
+    std::string_view token = text.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end);
+    return token;
+}
+
+// Receives each root move as soon as an engine has counted it. Returning false asks
+// the engine to stop; it then kills the remaining work and returns what it has,
+// marked as aborted.
+using MoveCallback = std::function<bool(const MoveCount&)>;
+
+class Engine {
+public:
+    virtual ~Engine() = default;
+
+    // The callback may be empty. It is called on the thread running the query.
+    virtual PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                            const MoveCallback& on_move) = 0;
+
+    PerftResult run_perft(const std::string& fen, const std::vector<std::string>& moves, int depth) {
+        return run_perft_streaming(fen, moves, depth, nullptr);
+    }
+
+    // Runs the query on its own thread so that several engines can work at the same time.
+    // The arguments are copied; the engine must outlive the returned future.
+    std::future<PerftResult> run_perft_async(std::string fen, std::vector<std::string> moves, int depth,
+                                             MoveCallback on_move = nullptr) {
+        return std::async(std::launch::async, [this, fen = std::move(fen), moves = std::move(moves), depth,
+                                               on_move = std::move(on_move)]() {
+            return run_perft_streaming(fen, moves, depth, on_move);
+        });
+    }
+};
+
+// Parses one line of divide output in place: "<move> <count>" for a root move (a ':'
+// after the move or a '-' between the two is accepted too), optionally followed by
+// key=value details (hash=<hex> in checksum mode, leaf counters in breakdown mode),
+// or the bare total on its own line. A count after a token that is no UCI move is
+// kept as an unrecognised move. Anything else is ignored.
+void parse_perft_line(std::string_view line, PerftResult& result) {
+    std::string_view first = next_token(line);
+    if (first.empty()) return;
+    std::string_view second = next_token(line);
+    if (second == "-" || second == ":") second = next_token(line);
+    if (!first.empty() && first.back() == ':') first.remove_suffix(1);
+
+    MoveCount entry{};
+    for (std::string_view detail = next_token(line); !detail.empty(); detail = next_token(line)) {
+        if (second.empty() || !parse_move_detail(detail, entry)) return;
+    }
+
+    long long count;
+    if (second.empty()) {
+        if (parse_count(first, count)) result.total_nodes = count;
+    } else if (parse_count(second, count)) {
+        if (parse_uci_move(first, entry.move)) {
+            entry.nodes = count;
+            result.moves.push_back(entry);
+        } else if (first == "Total" || first == "total") {
+            result.total_nodes = count;
+        } else {
+            result.unrecognised.emplace_back(first, count);
+        }
+    }
+}
+
+// parse_perft_line, passing a newly reported root move on to the callback. Returns
+// false once the callback asks to stop.
+bool stream_perft_line(std::string_view line, PerftResult& result, const MoveCallback& on_move, QueryStats& stats) {
+    size_t known_moves = result.moves.size();
+    {
+        PhaseTimer timer(stats.parse);
+        parse_perft_line(line, result);
+    }
+    if (!on_move || result.moves.size() == known_moves) return true;
+    PhaseTimer timer(stats.report);
+    return on_move(result.moves.back());
+}
+
+// Adds the query's share of a process's read wait and CPU time, given the readings
+// taken when the query started.
+void add_process_usage(QueryStats& stats, const Subprocess& process, double wait_before, const ProcessUsage& before) {
+    stats.wait += process.read_wait_seconds() - wait_before;
+    ProcessUsage after = process.usage();
+    if (after.cpu_seconds >= 0) stats.child_cpu = after.cpu_seconds - std::max(0.0, before.cpu_seconds);
+    stats.peak_rss_kb = after.peak_rss_kb;
+}
+
+void finish_query(QueryStats& stats, const PerftResult& result, std::chrono::steady_clock::time_point start) {
+    stats.nodes = result.total_nodes;
+    stats.total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    QUERY_LOG.add(stats);
+}
+
+// Identifies a build of the user engine, so that recompiling it invalidates its
+// cached results.
+std::string user_engine_id(const std::string& path) {
+    struct stat info {};
+    if (stat(path.c_str(), &info) != 0) return "user:" + path;
+    return "user:" + path + "@" + std::to_string(static_cast<long long>(info.st_mtime)) + ":" + std::to_string(static_cast<long long>(info.st_size));
+}
+
+class UserEngine : public Engine {
+private:
+    std::string path_;
+    bool persistent_ = false;
+    std::unique_ptr<Subprocess> process_; // long-lived engine, persistent mode only
+    std::string process_id_;              // user_engine_id of the build process_ runs
+    std::mutex mutex_;
+
+    // An engine that reads "isready" but never answers must not hang the debugger.
+    static constexpr int HANDSHAKE_TIMEOUT_SECONDS = 10;
+
+    // Starts the engine without arguments and waits for the "isready"/"readyok"
+    // handshake. Returns false if the engine does not speak the persistent protocol.
+    bool start_persistent() {
+        process_id_ = user_engine_id(path_);
+        try {
+            process_ = std::make_unique<Subprocess>(path_, std::vector<std::string>{});
+        } catch (const std::exception&) {
+            process_.reset();
+            return false;
+        }
+        process_->write("isready\n");
+        std::string line;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(HANDSHAKE_TIMEOUT_SECONDS);
+        for (int i = 0; i < 50; ++i) { // Try reading up to 50 lines
+            if (!process_->read_line(line, deadline)) break;
+            if (line.find("readyok") != std::string::npos) return true;
+        }
+        process_.reset();
+        return false;
+    }
+
+    PerftResult run_perft_persistent(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                     const MoveCallback& on_move, double spawn_seconds) {
+        auto start = std::chrono::steady_clock::now();
+        QueryStats stats{"user", depth};
+        stats.spawn = spawn_seconds;
+        ProcessUsage before = process_->usage();
+        double wait_before = process_->read_wait_seconds();
+
+        PerftResult result;
+        std::stringstream cmd;
+        cmd << "position fen " << fen;
+        if (!moves.empty()) {
+            cmd << " moves";
+            for (const auto& move : moves) cmd << " " << move;
+        }
+        cmd << "\n";
+        cmd << "go perft " << depth << "\n";
+        process_->write(cmd.str());
+
+        std::string_view line;
+        bool keep_process = true;
+        while (true) {
+            if (!process_->read_line(line)) {
+                // The engine died mid-query. Its answer is incomplete, and a new process
+                // is started for the next query.
+                result.crash = process_->wait();
+                if (result.crash.empty()) result.crash = "output ended before 'done'";
+                keep_process = false;
+                break;
+            }
+            if (line == "done") break;
+            if (!stream_perft_line(line, result, on_move, stats)) {
+                // The protocol has no way to interrupt a perft, so the process is
+                // killed and a fresh one is started for the next query.
+                keep_process = false;
+                result.aborted = true;
+                break;
+            }
+        }
+        add_process_usage(stats, *process_, wait_before, before);
+        if (!keep_process) process_.reset();
+        result.sort_moves();
+        finish_query(stats, result, start);
+        return result;
+    }
+
+public:
+    UserEngine(std::string path, bool persistent = false) : path_(std::move(path)) {
+        if (persistent) {
+            persistent_ = start_persistent();
+            if (!persistent_) {
+                std::cerr << Color::ORANGE << "Warning: engine did not answer 'isready' with 'readyok' within "
+                          << HANDSHAKE_TIMEOUT_SECONDS << " s. "
+                          << "Falling back to one process per query." << Color::RESET << std::endl;
+            }
+        }
+    }
+
+    ~UserEngine() override {
+        if (process_) process_->write("quit\n");
+    }
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        if (persistent_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // After a rebuild the old process would answer for the new build, so it is
+            // replaced.
+            if (process_ && user_engine_id(path_) != process_id_) process_.reset();
+            double spawn_seconds = 0;
+            bool running = process_ != nullptr;
+            if (!running) {
+                PhaseTimer timer(spawn_seconds);
+                running = start_persistent();
+            }
+            if (running) return run_perft_persistent(fen, moves, depth, on_move, spawn_seconds);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        QueryStats stats{"user", depth};
+        PerftResult result;
+        std::vector<std::string> args;
+        args.push_back(std::to_string(depth));
+        args.push_back(fen);
+        if (!moves.empty()) {
+            std::stringstream ss;
+            for (size_t i = 0; i < moves.size(); ++i) {
+                ss << moves[i] << (i == moves.size() - 1 ? "" : " ");
+            }
+            args.push_back(ss.str());
+        }
+
+        Subprocess proc(path_, args);
+        stats.spawn = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::string_view line;
+        while (proc.read_line(line)) {
+            if (!stream_perft_line(line, result, on_move, stats)) {
+                result.aborted = true; // the Subprocess destructor kills the engine
+                break;
+            }
+        }
+        // A crash after some output looks like a short answer; only the exit status tells.
+        if (!result.aborted) result.crash = proc.wait();
+        add_process_usage(stats, proc, 0, ProcessUsage{});
+        result.sort_moves();
+        finish_query(stats, result, start);
+        return result;
+    }
+};
+
+// Engine built as a shared library with this C ABI (see the plugin section of
+// chessengine_main.cpp):
+//
+//   int       perft_plugin_init(void);      once after loading, 0 on success
+//   long long perft_plugin_divide(const char* fen, const char* moves, int depth,
+//                                 int (*on_move)(void* context, const char* move, long long nodes),
+//                                 void* context);
+//
+// perft_plugin_divide reports each root move through on_move, which returns nonzero
+// to ask the engine to stop, and returns the total. Moves are space-separated UCI.
+// Queries are plain function calls: no process, no pipe, no text to parse.
+//
+// For checksum perft the library may also export perft_plugin_divide_checksum, taking
+// the same arguments except that on_move gets the root move's checksum as a fourth
+// argument (unsigned long long).
+class PluginEngine : public Engine {
+private:
+    using InitFunction = int (*)();
+    using MoveFunction = int (*)(void* context, const char* move, long long nodes);
+    using DivideFunction = long long (*)(const char* fen, const char* moves, int depth, MoveFunction on_move, void* context);
+    using ChecksumMoveFunction = int (*)(void* context, const char* move, long long nodes, unsigned long long hash);
+    using ChecksumDivideFunction = long long (*)(const char* fen, const char* moves, int depth, ChecksumMoveFunction on_move,
+                                                 void* context);
+
+    std::string path_;
+    std::string loaded_id_; // user_engine_id of the build that was loaded
+    DivideFunction divide_ = nullptr;
+    ChecksumDivideFunction checksum_divide_ = nullptr; // set only in checksum mode
+
+    struct Call {
+        PerftResult* result;
+        const MoveCallback* on_move;
+        QueryStats* stats;
+    };
+
+    static int on_plugin_move(void* context, const char* move, long long nodes) {
+        return report_move(*static_cast<Call*>(context), move, nodes, std::nullopt);
+    }
+
+    static int on_plugin_checksum_move(void* context, const char* move, long long nodes, unsigned long long hash) {
+        return report_move(*static_cast<Call*>(context), move, nodes, static_cast<uint64_t>(hash));
+    }
+
+    static int report_move(Call& call, const char* move, long long nodes, std::optional<uint64_t> hash) {
+        Move code;
+        if (!parse_uci_move(move, code)) {
+            call.result->unrecognised.emplace_back(move, nodes);
+            return 0;
+        }
+        call.result->moves.push_back({code, nodes, hash, std::nullopt});
+        if (!*call.on_move) return 0;
+        PhaseTimer timer(call.stats->report);
+        if ((*call.on_move)(call.result->moves.back())) return 0;
+        call.result->aborted = true;
+        return 1;
+    }
+
+public:
+    // The library is never unloaded: it may own threads or static state that
+    // outlive a query. Nor can a rebuilt one be loaded in its place, since dlopen
+    // returns the library already mapped.
+    PluginEngine(const std::string& path, bool checksums) : path_(path), loaded_id_(user_engine_id(path)) {
+        // Without a directory, dlopen would search the library path instead of the
+        // current directory.
+        std::string file = path.find_first_of("/\\") == std::string::npos ? "./" + path : path;
+        InitFunction init = nullptr;
+#ifdef _WIN32
+        HMODULE library = LoadLibraryA(file.c_str());
+        if (!library) throw std::runtime_error("Cannot load engine library '" + path + "'.");
+        init = reinterpret_cast<InitFunction>(GetProcAddress(library, "perft_plugin_init"));
+        divide_ = reinterpret_cast<DivideFunction>(GetProcAddress(library, "perft_plugin_divide"));
+        if (checksums) {
+            checksum_divide_ = reinterpret_cast<ChecksumDivideFunction>(GetProcAddress(library, "perft_plugin_divide_checksum"));
+        }
+#else
+        void* library = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!library) throw std::runtime_error("Cannot load engine library '" + path + "': " + dlerror());
+        init = reinterpret_cast<InitFunction>(dlsym(library, "perft_plugin_init"));
+        divide_ = reinterpret_cast<DivideFunction>(dlsym(library, "perft_plugin_divide"));
+        if (checksums) checksum_divide_ = reinterpret_cast<ChecksumDivideFunction>(dlsym(library, "perft_plugin_divide_checksum"));
+#endif
+        if (!init || !divide_) {
+            throw std::runtime_error("Engine library '" + path + "' does not export perft_plugin_init and perft_plugin_divide.");
+        }
+        if (init() != 0) throw std::runtime_error("perft_plugin_init of '" + path + "' failed.");
+        if (checksums && !checksum_divide_) {
+            std::cerr << Color::ORANGE << "Warning: '" << path << "' does not export perft_plugin_divide_checksum; "
+                      << "only node counts will be compared." << Color::RESET << std::endl;
+        }
+    }
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        // Engines are rarely reentrant, and every instance of a library shares its
+        // globals, so calls into plugins never overlap.
+        static std::mutex call_mutex;
+        std::lock_guard<std::mutex> lock(call_mutex);
+        static bool warned_changed = false;
+        if (!warned_changed && user_engine_id(path_) != loaded_id_) {
+            warned_changed = true;
+            std::cerr << Color::ORANGE << "Warning: '" << path_ << "' changed on disk since it was loaded. Queries still "
+                      << "run the loaded build; restart the debugger to load the new one." << Color::RESET << std::endl;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        QueryStats stats{"plugin", depth};
+        std::string move_list;
+        for (const auto& move : moves) move_list += (move_list.empty() ? "" : " ") + move;
+
+        PerftResult result;
+        Call call{&result, &on_move, &stats};
+        if (checksum_divide_) {
+            result.total_nodes = checksum_divide_(fen.c_str(), move_list.c_str(), depth, &PluginEngine::on_plugin_checksum_move, &call);
+        } else {
+            result.total_nodes = divide_(fen.c_str(), move_list.c_str(), depth, &PluginEngine::on_plugin_move, &call);
+        }
+        result.sort_moves();
+        stats.wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - stats.report;
+        finish_query(stats, result, start);
+        return result;
+    }
+};
+
+bool is_plugin_path(const std::string& path) {
+    for (const char* extension : {".so", ".dylib", ".dll"}) {
+        size_t length = std::strlen(extension);
+        if (path.size() > length && path.compare(path.size() - length, length, extension) == 0) return true;
+    }
+    return false;
+}
+
+// A shared library is loaded in-process; anything else is run as a program. Programs
+// learn about checksum mode from the PERFT_CHECKSUM environment variable.
+std::unique_ptr<Engine> make_user_engine(const std::string& path, bool persistent, bool checksums = false) {
+    if (is_plugin_path(path)) return std::make_unique<PluginEngine>(path, checksums);
+    return std::make_unique<UserEngine>(path, persistent);
+}
+
+// Names the engine behind stored results. It is asked again for every query, so an
+// engine rebuilt during a session does not get the results of the old build.
+using EngineId = std::function<std::string()>;
+
+class Stockfish : public Engine {
+private:
+    std::unique_ptr<Subprocess> process_;
+    std::mutex mutex_; // one query at a time per process
+
+    void start() {
+        try {
+            process_ = std::make_unique<Subprocess>("stockfish", std::vector<std::string>{});
+        } catch (const std::exception& e) {
+            throw std::runtime_error("CRITICAL: Failed to start the 'stockfish' process. Is it installed and in your system's PATH?");
+        }
+        
+        process_->write("uci\n");
+        std::string line;
+        bool uciok_received = false;
+        // Basic timeout mechanism
+        for(int i=0; i < 50; ++i) { // Try reading up to 50 lines
+            if(process_->read_line(line) && line.find("uciok") != std::string::npos) {
+                uciok_received = true;
+                break;
+            }
+        }
+        if (!uciok_received) {
+            throw std::runtime_error("CRITICAL: Did not receive 'uciok' confirmation from Stockfish. The engine may have failed to start correctly.");
+        }
+    }
+
+public:
+    Stockfish() { start(); }
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto start_time = std::chrono::steady_clock::now();
+        QueryStats stats{"stockfish", depth};
+        if (!process_) { // killed by an earlier aborted query
+            PhaseTimer timer(stats.spawn);
+            start();
+        }
+        ProcessUsage before = process_->usage();
+        double wait_before = process_->read_wait_seconds();
+
+        PerftResult result;
+        std::stringstream cmd;
+        cmd << "position fen " << fen;
+        if (!moves.empty()) {
+            cmd << " moves";
+            for (const auto& move : moves) cmd << " " << move;
+        }
+        cmd << "\n";
+        cmd << "go perft " << depth << "\n";
+        process_->write(cmd.str());
+        
+        static const std::string_view nodes_searched = "Nodes searched:";
+        std::string_view line;
+        while (true) {
+            if (!process_->read_line(line)) {
+                result.crash = process_->wait();
+                if (result.crash.empty()) result.crash = "output ended before 'Nodes searched'";
+                break;
+            }
+            if (line.substr(0, nodes_searched.size()) == nodes_searched) {
+                line.remove_prefix(nodes_searched.size());
+                parse_count(next_token(line), result.total_nodes);
+                break;
+            }
+            // Root moves look like "e2e4: 20".
+            if (!stream_perft_line(line, result, on_move, stats)) {
+                result.aborted = true;
+                break;
+            }
+        }
+        add_process_usage(stats, *process_, wait_before, before);
+        // Stockfish ignores "stop" during perft; restart it instead.
+        if (!result.complete()) process_.reset();
+        result.sort_moves();
+        finish_query(stats, result, start_time);
+        return result;
+    }
+};
+
+// In-process reference: the Board move generator, with no process, pipe or text
+// parsing in between. Useful where Stockfish is not installed.
+uint64_t builtin_perft(const Board& board, int depth) {
+    if (depth == 0) return 1;
+    MoveList list;
+    board.generate_legal(list);
+    if (depth == 1) return static_cast<uint64_t>(list.size); // bulk-count the last ply
+    uint64_t nodes = 0;
+    for (int i = 0; i < list.size; ++i) {
+        Board child = board;
+        child.make_move(list.moves[i]);
+        nodes += builtin_perft(child, depth - 1);
+    }
+    return nodes;
+}
+
+struct SubtreeCount {
+    uint64_t nodes = 0;
+    uint64_t hash = 0;
+    Breakdown breakdown{};
+};
+
+// Adds the breakdown counters of the leaf reached by playing `move` on `board`.
+void count_leaf(const Board& board, Move move, Breakdown& counters) {
+    int from = move_from(move), to = move_to(move);
+    int type = piece_type(board.mailbox[from]);
+    bool en_passant = type == PAWN && to == board.ep_square;
+    if (en_passant || board.mailbox[to] != NO_PIECE) ++counters[CAPTURES];
+    if (en_passant) ++counters[EN_PASSANT];
+    if (type == KING && (from - to == 2 || to - from == 2)) ++counters[CASTLES];
+    if (move_promo(move)) ++counters[PROMOTIONS];
+
+    Board child = board;
+    child.make_move(move);
+    if (!child.checkers()) return;
+    ++counters[CHECKS];
+    MoveList replies;
+    child.generate_legal(replies);
+    if (replies.size == 0) ++counters[MATES];
+}
+
+// builtin_perft that also sums the leaf hashes of checksum perft and/or the leaf
+// counters of breakdown perft; `path` is the path hash of the moves leading to
+// `board`. Leaves are still counted from their parent, without making the move
+// unless the breakdown needs it.
+SubtreeCount builtin_perft_detailed(const Board& board, int depth, uint64_t path, bool checksum, bool breakdown) {
+    if (depth == 0) return {1, leaf_hash(path), {}};
+    MoveList list;
+    board.generate_legal(list);
+    SubtreeCount count;
+    for (int i = 0; i < list.size; ++i) {
+        uint64_t child_path = path_hash(path, list.moves[i]);
+        if (depth == 1) {
+            ++count.nodes;
+            if (checksum) count.hash += leaf_hash(child_path);
+            if (breakdown) count_leaf(board, list.moves[i], count.breakdown);
+            continue;
+        }
+        Board child = board;
+        child.make_move(list.moves[i]);
+        SubtreeCount subtree = builtin_perft_detailed(child, depth - 1, child_path, checksum, breakdown);
+        count.nodes += subtree.nodes;
+        count.hash += subtree.hash;
+        for (int field = 0; field < BREAKDOWN_FIELDS; ++field) count.breakdown[field] += subtree.breakdown[field];
+    }
+    return count;
+}
+
+class BuiltinEngine : public Engine {
+private:
+    std::shared_ptr<WorkStealingPool> pool_;
+    bool checksums_;
+    bool breakdown_;
+
+    struct Subtree {
+        size_t root; // index of the root move the subtree belongs to
+        Board board;
+        uint64_t path;
+    };
+
+    SubtreeCount count_subtree(const Board& board, int depth, uint64_t path) const {
+        if (checksums_ || breakdown_) return builtin_perft_detailed(board, depth, path, checksums_, breakdown_);
+        return {builtin_perft(board, depth), 0, {}};
+    }
+
+    // Splits the tree below the root moves into independent subtrees, expanding ply by
+    // ply until there are enough tasks to keep every worker busy, then counts them on
+    // the pool. Each root move is passed to `report` as soon as all of its subtrees are
+    // counted; if that returns false the queued subtrees are skipped and false is returned.
+    bool parallel_divide(const std::vector<Subtree>& roots, int depth, const std::function<bool(size_t, SubtreeCount)>& report) {
+        std::vector<Subtree> frontier = roots;
+
+        const size_t wanted_tasks = pool_->size() * 16;
+        while (frontier.size() < wanted_tasks && depth > 2) {
+            std::vector<Subtree> next;
+            for (const auto& node : frontier) {
+                MoveList list;
+                node.board.generate_legal(list);
+                for (int i = 0; i < list.size; ++i) {
+                    Board child = node.board;
+                    child.make_move(list.moves[i]);
+                    next.push_back({node.root, child, path_hash(node.path, list.moves[i])});
+                }
+            }
+            frontier = std::move(next);
+            --depth;
+        }
+
+        auto cancelled = std::make_shared<std::atomic<bool>>(false);
+        std::vector<std::future<SubtreeCount>> futures;
+        futures.reserve(frontier.size());
+        for (const auto& node : frontier) {
+            futures.push_back(pool_->submit([this, node, depth, cancelled] {
+                return *cancelled ? SubtreeCount{} : count_subtree(node.board, depth, node.path);
+            }));
+        }
+
+        // The frontier is grouped by root move, so a root is complete once the next
+        // task belongs to a later one. Roots left without subtrees count zero.
+        std::vector<SubtreeCount> counts(roots.size());
+        size_t reported = 0;
+        for (size_t i = 0; i < futures.size(); ++i) {
+            SubtreeCount count = futures[i].get();
+            SubtreeCount& sum = counts[frontier[i].root];
+            sum.nodes += count.nodes;
+            sum.hash += count.hash;
+            for (int field = 0; field < BREAKDOWN_FIELDS; ++field) sum.breakdown[field] += count.breakdown[field];
+            size_t complete = i + 1 < futures.size() ? frontier[i + 1].root : roots.size();
+            for (; reported < complete; ++reported) {
+                if (!report(reported, counts[reported])) {
+                    *cancelled = true;
+                    return false;
+                }
+            }
+        }
+        for (; reported < roots.size(); ++reported) {
+            if (!report(reported, SubtreeCount{})) return false;
+        }
+        return true;
+    }
+
+public:
+    // With `checksums`, every root move also carries its checksum perft hash, and with
+    // `breakdown` its leaf counters.
+    explicit BuiltinEngine(std::shared_ptr<WorkStealingPool> pool = nullptr, bool checksums = false, bool breakdown = false)
+        : pool_(std::move(pool)), checksums_(checksums), breakdown_(breakdown) {}
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        auto start = std::chrono::steady_clock::now();
+        QueryStats stats{"builtin", depth};
+        PerftResult result;
+        Board board;
+        if (!board.parse_fen(fen)) {
+            std::cerr << "Error: built-in engine cannot parse FEN '" << fen << "'." << std::endl;
+            return result;
+        }
+        uint64_t path = PATH_HASH_BASIS;
+        for (const auto& move : moves) {
+            if (!board.apply_legal_uci(move)) {
+                std::cerr << "Error: '" << move << "' is not a legal move for the built-in engine." << std::endl;
+                return result;
+            }
+            path = path_hash(path, move);
+        }
+
+        MoveList list;
+        board.generate_legal(list);
+        std::vector<Subtree> roots;
+        for (int i = 0; i < list.size; ++i) {
+            roots.push_back({static_cast<size_t>(i), board, path_hash(path, list.moves[i])});
+            roots.back().board.make_move(list.moves[i]);
+        }
+
+        auto report = [&](size_t i, SubtreeCount count) {
+            long long nodes = static_cast<long long>(count.nodes);
+            result.moves.push_back({list.moves[i], nodes, checksums_ ? std::optional<uint64_t>(count.hash) : std::nullopt,
+                                    breakdown_ ? std::optional<Breakdown>(count.breakdown) : std::nullopt});
+            result.total_nodes += nodes;
+            if (!on_move) return true;
+            PhaseTimer timer(stats.report);
+            return on_move(result.moves.back());
+        };
+        bool finished = true;
+        if (pool_ && pool_->size() > 1 && depth >= 4) {
+            finished = parallel_divide(roots, depth - 1, report);
+        } else {
+            for (size_t i = 0; i < roots.size() && finished; ++i) {
+                SubtreeCount count = count_subtree(roots[i].board, depth - 1, roots[i].path);
+                // At depth 1 the root moves are the leaves.
+                if (depth == 1 && breakdown_) count_leaf(board, list.moves[i], count.breakdown);
+                finished = report(i, count);
+            }
+        }
+
+        result.aborted = !finished;
+        result.sort_moves();
+        // In-process, the engine's share is everything the callback did not take.
+        stats.wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - stats.report;
+        finish_query(stats, result, start);
+        return result;
+    }
+};
+
+// Interchangeable engine instances behind a single Engine. Each query borrows an
+// idle instance for its duration, so concurrent callers run in parallel up to the
+// number of instances instead of queueing on one process.
+class EnginePool : public Engine {
+private:
+    std::vector<std::unique_ptr<Engine>> engines_;
+    std::vector<Engine*> idle_;
+    std::mutex mutex_;
+    std::condition_variable available_;
+
+public:
+    explicit EnginePool(std::vector<std::unique_ptr<Engine>> engines) : engines_(std::move(engines)) {
+        for (auto& engine : engines_) idle_.push_back(engine.get());
+    }
+
+    size_t size() const { return engines_.size(); }
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        Engine* engine;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            available_.wait(lock, [this] { return !idle_.empty(); });
+            engine = idle_.back();
+            idle_.pop_back();
+        }
+        struct Release {
+            EnginePool* pool;
+            Engine* engine;
+            ~Release() {
+                {
+                    std::lock_guard<std::mutex> lock(pool->mutex_);
+                    pool->idle_.push_back(engine);
+                }
+                pool->available_.notify_one();
+            }
+        } release{this, engine};
+        return engine->run_perft_streaming(fen, moves, depth, on_move);
+    }
+};
+
+// Starts `count` Stockfish processes behind one EnginePool. Stockfish loads its
+// network at startup, so the handshakes run in parallel rather than one by one.
+std::unique_ptr<EnginePool> make_stockfish_pool(unsigned count) {
+    std::vector<std::future<std::unique_ptr<Engine>>> starting;
+    for (unsigned i = 0; i < count; ++i) {
+        starting.push_back(std::async(std::launch::async, []() -> std::unique_ptr<Engine> {
+            return std::make_unique<Stockfish>();
+        }));
+    }
+    std::vector<std::unique_ptr<Engine>> engines;
+    for (auto& engine : starting) engines.push_back(engine.get());
+    return std::make_unique<EnginePool>(std::move(engines));
+}
+
+// Finished root moves of long runs, appended to a file as each one completes, so
+// that a run interrupted by a crash or a reboot can be resumed without redoing them.
+// File format, one record per line:
+//   run TAB <fen> TAB <moves> TAB <depth>          a diff was started
+//   <unit key> TAB <move> TAB <nodes>              a root move was counted
+class Checkpoint {
+public:
+    struct Run {
+        std::string fen;
+        std::vector<std::string> moves;
+        int depth = 0;
+    };
+
+private:
+    std::map<std::string, MoveCount> units_;
+    std::optional<Run> last_run_;
+    std::ofstream file_;
+    std::mutex mutex_;
+
+public:
+    explicit Checkpoint(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            std::stringstream ss(line);
+            for (std::string field; std::getline(ss, field, '\t');) fields.push_back(field);
+            if (fields.size() < 3) continue;
+            long long value;
+            if (fields[0] == "run") {
+                if (fields.size() != 4 || !parse_count(fields[3], value)) continue;
+                Run run{fields[1], {}, static_cast<int>(value)};
+                std::stringstream moves(fields[2]);
+                for (std::string move; moves >> move;) run.moves.push_back(move);
+                last_run_ = run;
+            } else if (parse_count(fields[2], value)) {
+                // Further fields are the unit's checksum and breakdown, if any.
+                MoveCount unit{0, value, std::nullopt, std::nullopt};
+                bool valid = true;
+                for (size_t i = 3; i < fields.size(); ++i) valid = valid && parse_move_detail(fields[i], unit);
+                if (valid) units_[fields[0] + '\t' + fields[1]] = unit;
+            }
+        }
+        file_.open(path, std::ios::app);
+        if (!file_) throw std::runtime_error("Cannot write checkpoint file '" + path + "'.");
+    }
+
+    std::optional<MoveCount> find(const std::string& unit, Move move) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = units_.find(unit + '\t' + move_to_uci(move));
+        if (it == units_.end()) return std::nullopt;
+        MoveCount found = it->second;
+        found.move = move;
+        return found;
+    }
+
+    void store(const std::string& unit, const MoveCount& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string key = unit + '\t' + move_to_uci(entry.move);
+        units_[key] = entry;
+        file_ << key << '\t' << entry.nodes << format_move_details(entry, '\t') << std::endl; // flushed, so a crash loses at most this line
+    }
+
+    void start_run(const std::string& fen, const std::vector<std::string>& moves, int depth) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_run_ = Run{fen, moves, depth};
+        file_ << "run\t" << fen << '\t';
+        for (const auto& move : moves) file_ << move << ' ';
+        file_ << '\t' << depth << std::endl;
+    }
+
+    std::optional<Run> last_run() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_run_;
+    }
+};
+
+// Splits one divide into independent queries, one per root move at depth - 1, and
+// runs them concurrently on an EnginePool. The root moves come from a depth 1 query
+// to the same engine, so a single-threaded engine is spread over as many processes
+// as the pool holds without any change to the engine contract. With a Checkpoint,
+// each finished root move is recorded and skipped when the query is run again.
+class FanOutEngine : public Engine {
+private:
+    std::unique_ptr<EnginePool> pool_;
+    std::shared_ptr<Checkpoint> checkpoint_;
+    EngineId engine_id_;
+
+public:
+    explicit FanOutEngine(std::unique_ptr<EnginePool> pool, std::shared_ptr<Checkpoint> checkpoint = nullptr,
+                          EngineId engine_id = nullptr)
+        : pool_(std::move(pool)), checkpoint_(std::move(checkpoint)), engine_id_(std::move(engine_id)) {}
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        if (depth < 2 || (pool_->size() < 2 && !checkpoint_)) return pool_->run_perft_streaming(fen, moves, depth, on_move);
+
+        std::string id = engine_id_ ? engine_id_() : "";
+        std::string unit = id + "|" + fen + "|";
+        for (const auto& move : moves) unit += move + " ";
+        unit += "|" + std::to_string(depth);
+
+        PerftResult roots = pool_->run_perft(fen, moves, 1);
+        if (!roots.crash.empty()) return roots;
+        // A root move that is no UCI move cannot be passed back to the engine, so the
+        // query is run whole.
+        if (!roots.unrecognised.empty()) return pool_->run_perft_streaming(fen, moves, depth, on_move);
+        PerftResult result;
+        std::atomic<size_t> next{0};
+        std::atomic<bool> stop{false};
+        std::mutex mutex;
+        // Lets a query that is still running be killed once the caller asked to stop.
+        MoveCallback keep_going = [&stop](const MoveCount&) { return !stop; };
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < roots.moves.size() && !stop; i = next++) {
+                Move root_move = roots.moves[i].move;
+                std::optional<MoveCount> finished = checkpoint_ ? checkpoint_->find(unit, root_move) : std::nullopt;
+                MoveCount entry = finished.value_or(MoveCount{root_move, 0, std::nullopt, std::nullopt});
+                if (!finished) {
+                    std::vector<std::string> child_moves = moves;
+                    child_moves.push_back(move_to_uci(root_move));
+                    PerftResult child = pool_->run_perft_streaming(fen, child_moves, depth - 1, keep_going);
+                    // Only a child that ran to the end gives the root move's count; a crashed
+                    // one is neither merged nor checkpointed, and fails the whole query.
+                    if (!child.complete()) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (!child.crash.empty() && result.crash.empty()) {
+                            result.crash = child.crash + " while counting " + move_to_uci(root_move);
+                        }
+                        return;
+                    }
+                    // Some engines print no total when they only list moves.
+                    entry.nodes = child.total_nodes;
+                    if (entry.nodes == 0) {
+                        for (const auto& move : child.moves) entry.nodes += move.nodes;
+                        for (const auto& row : child.unrecognised) entry.nodes += row.second;
+                    }
+                    // Checksums and breakdowns are sums over the leaves, and the child
+                    // moves' leaf paths already start at the base FEN, so they add up.
+                    for (const auto& move : child.moves) {
+                        if (move.hash) entry.hash = entry.hash.value_or(0) + *move.hash;
+                        if (move.breakdown) add_breakdown(entry.breakdown, *move.breakdown);
+                    }
+                    // As with the cache, an empty answer is more likely a crash than a mate,
+                    // and a unit counted by another build than the one in its key is not stored.
+                    if (checkpoint_ && (entry.nodes != 0 || !child.moves.empty()) && (!engine_id_ || engine_id_() == id)) {
+                        checkpoint_->store(unit, entry);
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                result.moves.push_back(entry);
+                result.total_nodes += entry.nodes;
+                if (on_move && !on_move(result.moves.back())) stop = true;
+            }
+        };
+        std::vector<std::future<void>> workers;
+        for (size_t i = 0; i < std::min(pool_->size(), roots.moves.size()); ++i) {
+            workers.push_back(std::async(std::launch::async, worker));
+        }
+        for (auto& w : workers) w.get();
+
+        // A stop that came after the last root move had finished leaves the result complete.
+        result.aborted = result.crash.empty() && result.moves.size() < roots.moves.size();
+        result.sort_moves();
+        return result;
+    }
+};
+
+// =================================================================================
+// ================================= Result Cache ==================================
+// =================================================================================
+
+// Perft results keyed by engine, position and depth. With a file path, entries are
+// loaded at startup and appended as they are computed, so they survive sessions.
+// File format, one entry per line: <key> TAB <total> TAB <move>:<count>[:<key>=<value>...] ...
+class PerftCache {
+private:
+    std::map<std::string, PerftResult> entries_;
+    std::ofstream file_;
+    std::mutex mutex_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+
+public:
+    explicit PerftCache(const std::string& path = "") {
+        if (path.empty()) return;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t tab1 = line.find('\t');
+            size_t tab2 = tab1 == std::string::npos ? std::string::npos : line.find('\t', tab1 + 1);
+            if (tab2 == std::string::npos) continue;
+            PerftResult result;
+            try {
+                result.total_nodes = std::stoll(line.substr(tab1 + 1, tab2 - tab1 - 1));
+            } catch (...) { continue; }
+            std::string_view rest = std::string_view(line).substr(tab2 + 1);
+            for (std::string_view entry = next_token(rest); !entry.empty(); entry = next_token(rest)) {
+                std::vector<std::string_view> fields;
+                for (size_t start = 0, colon = 0; colon != std::string_view::npos; start = colon + 1) {
+                    colon = entry.find(':', start);
+                    fields.push_back(entry.substr(start, colon == std::string_view::npos ? colon : colon - start));
+                }
+                MoveCount move{};
+                bool valid = fields.size() >= 2 && parse_uci_move(fields[0], move.move) && parse_count(fields[1], move.nodes);
+                for (size_t i = 2; i < fields.size(); ++i) valid = valid && parse_move_detail(fields[i], move);
+                if (valid) result.moves.push_back(move);
+            }
+            result.sort_moves();
+            entries_[line.substr(0, tab1)] = std::move(result);
+        }
+        file_.open(path, std::ios::app);
+        if (!file_) {
+            std::cerr << Color::ORANGE << "Warning: cannot write cache file '" << path << "'." << Color::RESET << std::endl;
+        }
+    }
+
+    std::optional<PerftResult> find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            ++misses_;
+            return std::nullopt;
+        }
+        ++hits_;
+        return it->second;
+    }
+
+    void store(const std::string& key, const PerftResult& result) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!entries_.emplace(key, result).second || !file_) return;
+        file_ << key << '\t' << result.total_nodes << '\t';
+        for (const auto& entry : result.moves) file_ << move_to_uci(entry.move) << ':' << entry.nodes << format_move_details(entry, ':') << ' ';
+        file_ << std::endl;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        hits_ = misses_ = 0;
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "Cache: " << entries_.size() << " entries, " << hits_ << " hits, " << misses_ << " misses." << std::endl;
+    }
+};
+
+// Answers repeated queries from a PerftCache before asking the wrapped engine.
+// With transposition keys the position reached by the moves is normalised, so
+// different move orders share an entry. That is only sound for a correct engine:
+// a buggy one may answer differently depending on how the position was reached,
+// so the user engine is keyed by the exact FEN and move path instead.
+class CachedEngine : public Engine {
+private:
+    std::unique_ptr<Engine> inner_;
+    std::shared_ptr<PerftCache> cache_;
+    EngineId engine_id_;
+    bool transposition_keys_;
+
+    std::string make_key(const std::string& id, const std::string& fen, const std::vector<std::string>& moves, int depth) const {
+        std::string key = id + "|";
+        Board board;
+        bool normalised = transposition_keys_ && board.parse_fen(fen);
+        for (const auto& move : moves) {
+            if (!normalised) break;
+            normalised = board.apply_uci(move);
+        }
+        if (normalised) {
+            key += board.key();
+        } else {
+            key += fen + "|";
+            for (const auto& move : moves) key += move + " ";
+        }
+        return key + "|" + std::to_string(depth);
+    }
+
+public:
+    CachedEngine(std::unique_ptr<Engine> inner, std::shared_ptr<PerftCache> cache, EngineId engine_id, bool transposition_keys)
+        : inner_(std::move(inner)), cache_(std::move(cache)), engine_id_(std::move(engine_id)), transposition_keys_(transposition_keys) {}
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        auto start = std::chrono::steady_clock::now();
+        std::string id = engine_id_();
+        std::string key = make_key(id, fen, moves, depth);
+        if (auto cached = cache_->find(key)) {
+            QueryStats stats{"cache", depth};
+            for (const auto& entry : cached->moves) {
+                PhaseTimer timer(stats.report);
+                if (on_move && !on_move(entry)) break;
+            }
+            finish_query(stats, *cached, start);
+            return *cached;
+        }
+        PerftResult result = inner_->run_perft_streaming(fen, moves, depth, on_move);
+        // An empty answer is far more likely a crashed engine than a mated root. An
+        // engine rebuilt during the query may have answered from either build. The
+        // cache file has no place for unrecognised moves, so answers with them are
+        // asked again.
+        if (result.complete() && (result.total_nodes != 0 || !result.moves.empty()) && result.unrecognised.empty() &&
+            engine_id_() == id) {
+            cache_->store(key, result);
+        }
+        return result;
+    }
+};
+
+// =================================================================================
+// ============================ Golden Results Database ============================
+// =================================================================================
+
+// Precomputed divide results of standard positions, built once from a trusted engine
+// with --golden-build and memory-mapped with --golden. Lookups binary-search the
+// mapped index in place; only the moves of a hit are copied out.
+//
+// Layout (native byte order): a GoldenHeader, `entry_count` GoldenIndexEntry records
+// sorted by (key, depth), then the GoldenMove records every entry points into.
+// The key is a 64-bit FNV-1a hash of the normalised position.
+struct GoldenHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t moves_offset;
+    uint64_t move_count;
+};
+
+struct GoldenIndexEntry {
+    uint64_t key;
+    uint32_t depth;
+    uint32_t move_count;
+    uint64_t first_move;
+    int64_t total;
+};
+
+struct GoldenMove {
+    int64_t nodes;
+    uint16_t move;
+    uint16_t reserved[3];
+};
+
+static_assert(sizeof(GoldenHeader) == 32 && sizeof(GoldenIndexEntry) == 32 && sizeof(GoldenMove) == 16,
+              "golden database records must not contain padding");
+
+constexpr char GOLDEN_MAGIC[8] = {'P', 'E', 'R', 'F', 'T', 'D', 'B', '1'};
+constexpr uint32_t GOLDEN_VERSION = 1;
+
+inline uint64_t golden_key(const Board& board) { return path_hash(PATH_HASH_BASIS, board.key()); }
+
+// Read-only mapping of a whole file, unmapped on destruction.
+class MappedFile {
+private:
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open '" + path + "'.");
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size)) throw std::runtime_error("Cannot read the size of '" + path + "'.");
+        size_ = static_cast<size_t>(size.QuadPart);
+        if (size_ == 0) return;
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_) data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) throw std::runtime_error("Cannot map '" + path + "'.");
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open '" + path + "': " + std::strerror(errno));
+        struct stat info {};
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot read the size of '" + path + "'.");
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ == 0) {
+            close(fd);
+            return;
+        }
+        // The mapping keeps its own reference to the file.
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) throw std::runtime_error("Cannot map '" + path + "': " + std::strerror(errno));
+        data_ = static_cast<const unsigned char*>(data);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+        if (data_) munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+class GoldenDb {
+private:
+    MappedFile file_;
+    const GoldenIndexEntry* index_ = nullptr;
+    const GoldenMove* moves_ = nullptr;
+    uint32_t entry_count_ = 0;
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+
+public:
+    explicit GoldenDb(const std::string& path) : file_(path) {
+        GoldenHeader header{};
+        if (file_.size() < sizeof(header)) throw std::runtime_error("'" + path + "' is not a golden database.");
+        std::memcpy(&header, file_.data(), sizeof(header));
+        if (std::memcmp(header.magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC)) != 0) {
+            throw std::runtime_error("'" + path + "' is not a golden database.");
+        }
+        if (header.version != GOLDEN_VERSION) {
+            throw std::runtime_error("'" + path + "' has golden database version " + std::to_string(header.version) +
+                                     ", expected " + std::to_string(GOLDEN_VERSION) + ".");
+        }
+        uint64_t index_end = sizeof(header) + uint64_t{header.entry_count} * sizeof(GoldenIndexEntry);
+        if (header.moves_offset < index_end || header.moves_offset % alignof(GoldenMove) != 0 ||
+            header.move_count > (file_.size() - std::min<uint64_t>(header.moves_offset, file_.size())) / sizeof(GoldenMove)) {
+            throw std::runtime_error("'" + path + "' is truncated or corrupt.");
+        }
+        // mmap returns page-aligned memory, and every section starts at a multiple of 8.
+        index_ = reinterpret_cast<const GoldenIndexEntry*>(file_.data() + sizeof(header));
+        moves_ = reinterpret_cast<const GoldenMove*>(file_.data() + header.moves_offset);
+        entry_count_ = header.entry_count;
+        for (uint32_t i = 0; i < entry_count_; ++i) {
+            const GoldenIndexEntry& entry = index_[i];
+            bool sorted = i == 0 || std::tie(index_[i - 1].key, index_[i - 1].depth) < std::tie(entry.key, entry.depth);
+            if (!sorted || entry.first_move > header.move_count || entry.move_count > header.move_count - entry.first_move) {
+                throw std::runtime_error("'" + path + "' is truncated or corrupt.");
+            }
+        }
+    }
+
+    size_t size() const { return entry_count_; }
+
+    std::optional<PerftResult> find(uint64_t key, int depth) {
+        const GoldenIndexEntry* end = index_ + entry_count_;
+        const GoldenIndexEntry* it = std::lower_bound(index_, end, std::make_pair(key, static_cast<uint32_t>(depth)),
+            [](const GoldenIndexEntry& entry, const std::pair<uint64_t, uint32_t>& wanted) {
+                return std::tie(entry.key, entry.depth) < std::tie(wanted.first, wanted.second);
+            });
+        if (depth <= 0 || it == end || it->key != key || it->depth != static_cast<uint32_t>(depth)) {
+            ++misses_;
+            return std::nullopt;
+        }
+        ++hits_;
+        PerftResult result;
+        result.total_nodes = it->total;
+        result.moves.reserve(it->move_count);
+        for (const GoldenMove* move = moves_ + it->first_move; move != moves_ + it->first_move + it->move_count; ++move) {
+            result.moves.push_back({move->move, move->nodes, std::nullopt, std::nullopt});
+        }
+        return result;
+    }
+
+    void print_stats() const {
+        std::cout << "Golden database: " << entry_count_ << " entries, " << hits_ << " hits, " << misses_ << " misses." << std::endl;
+    }
+
+    // Entries are keyed by (golden_key, depth); their moves must be sorted.
+    static void write(const std::string& path, const std::map<std::pair<uint64_t, int>, PerftResult>& entries) {
+        GoldenHeader header{};
+        std::memcpy(header.magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC));
+        header.version = GOLDEN_VERSION;
+        header.entry_count = static_cast<uint32_t>(entries.size());
+        header.moves_offset = sizeof(header) + entries.size() * sizeof(GoldenIndexEntry);
+
+        std::vector<GoldenIndexEntry> index;
+        std::vector<GoldenMove> moves;
+        for (const auto& [key, result] : entries) {
+            index.push_back({key.first, static_cast<uint32_t>(key.second), static_cast<uint32_t>(result.moves.size()),
+                             moves.size(), result.total_nodes});
+            for (const auto& entry : result.moves) moves.push_back({entry.nodes, entry.move, {0, 0, 0}});
+        }
+        header.move_count = moves.size();
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(GoldenIndexEntry)));
+        out.write(reinterpret_cast<const char*>(moves.data()), static_cast<std::streamsize>(moves.size() * sizeof(GoldenMove)));
+        if (!out.flush()) throw std::runtime_error("Cannot write golden database '" + path + "'.");
+    }
+};
+
+// Creates the wrapped engine on its first query, for engines that may never be needed.
+// If creating it fails, the query throws and the next one tries again.
+class LazyEngine : public Engine {
+private:
+    std::function<std::unique_ptr<Engine>()> factory_;
+    std::unique_ptr<Engine> engine_;
+    std::once_flag created_;
+
+public:
+    explicit LazyEngine(std::function<std::unique_ptr<Engine>()> factory) : factory_(std::move(factory)) {}
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        std::call_once(created_, [this] { engine_ = factory_(); });
+        return engine_->run_perft_streaming(fen, moves, depth, on_move);
+    }
+};
+
+// Answers queries for positions in a GoldenDb without running the wrapped engine.
+// Positions are normalised as for transposition keys, so any move order that
+// reaches a stored position is a hit.
+class GoldenEngine : public Engine {
+private:
+    std::unique_ptr<Engine> inner_;
+    std::shared_ptr<GoldenDb> db_;
+
+public:
+    GoldenEngine(std::unique_ptr<Engine> inner, std::shared_ptr<GoldenDb> db) : inner_(std::move(inner)), db_(std::move(db)) {}
+
+    PerftResult run_perft_streaming(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                                    const MoveCallback& on_move) override {
+        auto start = std::chrono::steady_clock::now();
+        Board board;
+        bool valid = board.parse_fen(fen);
+        for (const auto& move : moves) {
+            if (!valid) break;
+            valid = board.apply_uci(move);
+        }
+        std::optional<PerftResult> golden = valid ? db_->find(golden_key(board), depth) : std::nullopt;
+        if (!golden) return inner_->run_perft_streaming(fen, moves, depth, on_move);
+
+        QueryStats stats{"golden", depth};
+        for (const auto& entry : golden->moves) {
+            PhaseTimer timer(stats.report);
+            if (on_move && !on_move(entry)) break;
+        }
+        finish_query(stats, *golden, start);
+        return *golden;
+    }
+};
+
+// =================================================================================
+// =========================== Diff and State Management ===========================
+// =================================================================================
+
+struct DiffEntry {
+    Move move;
+    std::optional<long long> user;
+    std::optional<long long> reference;
+    std::optional<uint64_t> user_hash;
+    std::optional<uint64_t> reference_hash;
+    std::optional<Breakdown> user_breakdown;
+    std::optional<Breakdown> reference_breakdown;
+
+    // The counts agree but the checksums do not: errors that cancel out in the count.
+    bool checksum_differs() const {
+        return user && user == reference && user_hash && reference_hash && *user_hash != *reference_hash;
+    }
+
+    bool breakdown_differs() const { return user_breakdown && reference_breakdown && *user_breakdown != *reference_breakdown; }
+
+    // Both engines play the move but disagree about the subtree below it.
+    bool subtree_differs() const {
+        return user && reference && (*user != *reference || checksum_differs() || breakdown_differs());
+    }
+
+    // What differs besides the count, e.g. "castles +2, checks -1" (your engine minus
+    // the reference). Empty if nothing does.
+    std::string detail() const {
+        std::string text;
+        if (breakdown_differs()) {
+            for (int i = 0; i < BREAKDOWN_FIELDS; ++i) {
+                long long delta = (*user_breakdown)[i] - (*reference_breakdown)[i];
+                if (delta == 0) continue;
+                text += (text.empty() ? "" : ", ") + std::string(BREAKDOWN_NAMES[i]) + (delta > 0 ? " +" : " ") + std::to_string(delta);
+            }
+        }
+        if (checksum_differs()) text += (text.empty() ? "" : ", ") + std::string("checksum differs");
+        return text;
+    }
+};
+
+struct DiffResult {
+    std::pair<long long, long long> total_nodes;
+    std::pair<std::optional<Breakdown>, std::optional<Breakdown>> total_breakdown; // summed over the root moves
+    std::vector<DiffEntry> moves; // sorted by move code
+    bool aborted = false;         // an engine stopped early; moves may be missing
+    std::pair<std::string, std::string> crash; // how each engine failed mid-query, empty if it did not
+    std::vector<std::pair<std::string, long long>> unrecognised; // your engine's rows that are no UCI move: extra moves
+
+    // Both move arrays are sorted, so a single linear merge lines them up.
+    DiffResult(const PerftResult& user_result, const PerftResult& reference_result) {
+        total_nodes = {user_result.total_nodes, reference_result.total_nodes};
+        aborted = user_result.aborted || reference_result.aborted;
+        crash = {user_result.crash, reference_result.crash};
+        unrecognised = user_result.unrecognised;
+        auto user = user_result.moves.begin(), user_end = user_result.moves.end();
+        auto reference = reference_result.moves.begin(), reference_end = reference_result.moves.end();
+        moves.reserve(std::max(user_result.moves.size(), reference_result.moves.size()));
+        for (const auto& entry : user_result.moves) {
+            if (entry.breakdown) add_breakdown(total_breakdown.first, *entry.breakdown);
+        }
+        for (const auto& entry : reference_result.moves) {
+            if (entry.breakdown) add_breakdown(total_breakdown.second, *entry.breakdown);
+        }
+        while (user != user_end || reference != reference_end) {
+            if (reference == reference_end || (user != user_end && user->move < reference->move)) {
+                moves.push_back({user->move, user->nodes, std::nullopt, user->hash, std::nullopt, user->breakdown, std::nullopt});
+                ++user;
+            } else if (user == user_end || reference->move < user->move) {
+                moves.push_back({reference->move, std::nullopt, reference->nodes, std::nullopt, reference->hash, std::nullopt,
+                                 reference->breakdown});
+                ++reference;
+            } else {
+                moves.push_back({user->move, user->nodes, reference->nodes, user->hash, reference->hash, user->breakdown,
+                                 reference->breakdown});
+                ++user;
+                ++reference;
+            }
+        }
+    }
+
+    bool crashed() const { return !crash.first.empty() || !crash.second.empty(); }
+};
+
+// Names the engine that failed mid-query and how, or empty if neither did. Moves it
+// never reported are unknown rather than missing, so a crash is reported instead of
+// a move list.
+std::string describe_crash(const DiffResult& diff, const std::string& reference_name) {
+    std::string text;
+    if (!diff.crash.first.empty()) text = "Your engine crashed: " + diff.crash.first;
+    if (!diff.crash.second.empty()) text += (text.empty() ? "" : "; ") + reference_name + " crashed: " + diff.crash.second;
+    return text;
+}
+
+// One step of a bisection: the moves only one engine plays, and the mismatched move
+// with the smallest subtree to descend into.
+struct BisectStep {
+    std::vector<std::string> missing; // played by the reference only
+    std::vector<std::string> extra;   // played by your engine only
+    std::string next_move;            // empty if no subtree differs
+};
+
+BisectStep bisect_step(const DiffResult& diff) {
+    BisectStep step;
+    for (const auto& row : diff.unrecognised) step.extra.push_back(row.first);
+    long long next_size = 0;
+    for (const auto& entry : diff.moves) {
+        if (!entry.user.has_value()) step.missing.push_back(move_to_uci(entry.move));
+        else if (!entry.reference.has_value()) step.extra.push_back(move_to_uci(entry.move));
+        else if (entry.subtree_differs() && (step.next_move.empty() || entry.reference.value() < next_size)) {
+            step.next_move = move_to_uci(entry.move);
+            next_size = entry.reference.value();
+        }
+    }
+    return step;
+}
+
+void print_diff_header(size_t width, const std::string& reference_name) {
+    std::cout << std::left << std::setw(8) << "Move"
+              << std::right << std::setw(width) << "YourEngine"
+              << std::right << std::setw(width + 1) << reference_name << std::endl;
+    std::cout << std::left << std::setw(8) << "--------"
+              << std::right << std::setw(width) << "----------"
+              << std::right << std::setw(width + 1) << "----------" << std::endl;
+}
+
+// `detail` is DiffEntry::detail(); a row with one is highlighted even if the counts agree.
+void print_diff_row(const std::string& move, std::optional<long long> user, std::optional<long long> reference, size_t width,
+                    const std::string& detail = "") {
+    bool missing_in_user = !user.has_value();
+    bool missing_in_reference = !reference.has_value();
+    bool counts_differ = (!missing_in_user && !missing_in_reference && *user != *reference) || !detail.empty();
+
+    if (missing_in_user) std::cout << Color::PINK;
+    else if (missing_in_reference) std::cout << Color::CYAN;
+    else if (counts_differ) std::cout << Color::ORANGE;
+
+    std::cout << std::left << std::setw(8) << move;
+
+    if (missing_in_user) {
+        std::cout << std::right << std::setw(width) << "-";
+    } else {
+        std::cout << std::right << std::setw(width) << *user;
+    }
+
+    if (missing_in_reference) {
+        std::cout << std::right << std::setw(width + 1) << "-";
+    } else {
+        std::cout << std::right << std::setw(width + 1) << *reference;
+    }
+    if (!detail.empty()) std::cout << "  " << detail;
+
+    std::cout << std::endl;
+
+    if (missing_in_user || missing_in_reference || counts_differ) {
+        std::cout << Color::RESET;
+    }
+}
+
+void print_diff_total(const DiffResult& diff) {
+    std::cout << "\n";
+    bool total_is_different = diff.total_nodes.first != diff.total_nodes.second;
+    if (total_is_different) std::cout << Color::ORANGE;
+    std::cout << "Total    " << diff.total_nodes.first << "\t" << diff.total_nodes.second << std::endl;
+    if (total_is_different) std::cout << Color::RESET;
+
+    // Which kind of leaf is off usually names the bug: "castles" or "ep" straight away.
+    const auto& [user, reference] = diff.total_breakdown;
+    if (!user || !reference) return;
+    std::cout << "\n" << std::left << std::setw(12) << "Leaves" << std::right << std::setw(12) << "YourEngine"
+              << std::setw(13) << "Reference" << std::endl;
+    for (int i = 0; i < BREAKDOWN_FIELDS; ++i) {
+        bool differs = (*user)[i] != (*reference)[i];
+        if (differs) std::cout << Color::ORANGE;
+        std::cout << std::left << std::setw(12) << BREAKDOWN_NAMES[i] << std::right << std::setw(12) << (*user)[i]
+                  << std::setw(13) << (*reference)[i] << std::endl;
+        if (differs) std::cout << Color::RESET;
+    }
+}
+
+void print_diff(const DiffResult& diff, const std::string& reference_name = "Stockfish") {
+    size_t max_node_width = 0;
+    for (const auto& entry : diff.moves) {
+        if (entry.user.has_value()) {
+            max_node_width = std::max(max_node_width, std::to_string(entry.user.value()).length());
+        }
+        if (entry.reference.has_value()) {
+            max_node_width = std::max(max_node_width, std::to_string(entry.reference.value()).length());
+        }
+    }
+    for (const auto& row : diff.unrecognised) max_node_width = std::max(max_node_width, std::to_string(row.second).length());
+    max_node_width = std::max(max_node_width, (size_t)10);
+
+    print_diff_header(max_node_width, reference_name);
+
+    // Listed alphabetically, as engines usually print them.
+    std::vector<std::pair<std::string, const DiffEntry*>> rows;
+    for (const auto& entry : diff.moves) rows.emplace_back(move_to_uci(entry.move), &entry);
+    std::sort(rows.begin(), rows.end());
+
+    for (const auto& row : rows) {
+        print_diff_row(row.first, row.second->user, row.second->reference, max_node_width, row.second->detail());
+    }
+    for (const auto& row : diff.unrecognised) print_diff_row(row.first, row.second, std::nullopt, max_node_width);
+    print_diff_total(diff);
+}
+
+// Lines up root moves from both engines while they are still counting. A move is
+// settled as soon as both sides have reported it, and printed at that point when
+// `print` is set. With `stop_on_mismatch` the first differing count or detail makes both
+// callbacks return false, so the engines drop the rest of the run.
+class LiveDiff {
+private:
+    std::mutex mutex_;
+    std::unordered_map<Move, MoveCount> pending_[2]; // reported by one side only so far
+    std::optional<Move> first_mismatch_;
+    bool stop_on_mismatch_;
+    bool print_;
+    bool stopped_ = false;
+
+    bool report(int side, const MoveCount& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_) return false;
+        auto& other = pending_[1 - side];
+        auto it = other.find(entry.move);
+        if (it == other.end()) {
+            pending_[side][entry.move] = entry;
+            return true;
+        }
+        const MoveCount& user = side == 0 ? entry : it->second;
+        const MoveCount& reference = side == 0 ? it->second : entry;
+        DiffEntry settled{entry.move, user.nodes, reference.nodes, user.hash, reference.hash, user.breakdown, reference.breakdown};
+        other.erase(it);
+
+        if (print_) print_diff_row(move_to_uci(entry.move), settled.user, settled.reference, WIDTH, settled.detail());
+        if (settled.subtree_differs() && !first_mismatch_) {
+            first_mismatch_ = entry.move;
+            stopped_ = stop_on_mismatch_;
+        }
+        return !stopped_;
+    }
+
+public:
+    static constexpr size_t WIDTH = 12; // counts arrive before their widths are known
+
+    LiveDiff(bool stop_on_mismatch, bool print) : stop_on_mismatch_(stop_on_mismatch), print_(print) {}
+
+    MoveCallback user_callback() { return [this](const MoveCount& entry) { return report(0, entry); }; }
+    MoveCallback reference_callback() { return [this](const MoveCount& entry) { return report(1, entry); }; }
+
+    std::optional<Move> first_mismatch() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return first_mismatch_;
+    }
+};
+
+struct Options {
+    std::string user_engine_path;
+    bool persistent = false;
+    std::string reference = "stockfish";
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool use_cache = true;
+    std::string cache_file;
+    std::string suite_file;
+    int suite_depth = 0;
+    bool bench = false;
+    int bench_runs = 5;
+    std::string bench_against;
+    std::string bench_json;
+    bool early_abort = false;
+    unsigned fan_out = 1;
+    unsigned stockfish_pool = 1;
+    std::string checkpoint_file;
+    bool checksum = false;
+    bool breakdown = false;
+    std::string golden_file;
+    std::string golden_build;
+    std::string golden_oracle = "stockfish";
+    int golden_depth = 0;
+    int golden_plies = 1;
+    std::string serve_socket;
+};
+
+class State {
+private:
+    std::unique_ptr<Engine> user_engine_;
+    std::unique_ptr<Engine> reference_engine_;
+    std::string reference_name_;
+    std::shared_ptr<PerftCache> cache_;
+    std::shared_ptr<GoldenDb> golden_;
+    std::shared_ptr<Checkpoint> checkpoint_;
+    std::shared_ptr<WorkStealingPool> pool_;
+    std::string fen_ = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    std::vector<std::string> moves_;
+    int depth_ = 1;
+    bool early_abort_ = false;
+    // Details the user engine was asked for and is not known to lack. Plugins are
+    // checked when they are loaded; a process is only known by what it prints.
+    bool expect_hashes_ = false;
+    bool expect_breakdown_ = false;
+    std::atomic<bool> warned_hashes_{false};
+    std::atomic<bool> warned_breakdown_{false};
+
+    // An engine that ignores PERFT_CHECKSUM or PERFT_BREAKDOWN would otherwise be
+    // compared on counts alone without a word.
+    void warn_missing_details(const PerftResult& result) {
+        if (result.moves.empty()) return;
+        bool hashes = false, breakdown = false;
+        for (const auto& entry : result.moves) {
+            hashes = hashes || entry.hash;
+            breakdown = breakdown || entry.breakdown;
+        }
+        if (expect_hashes_ && !hashes && !warned_hashes_.exchange(true)) {
+            std::cerr << Color::ORANGE << "Warning: your engine printed no hash=<checksum> after its moves; only node counts "
+                      << "are compared. Does it read PERFT_CHECKSUM?" << Color::RESET << std::endl;
+        }
+        if (expect_breakdown_ && !breakdown && !warned_breakdown_.exchange(true)) {
+            std::cerr << Color::ORANGE << "Warning: your engine printed no leaf counters after its moves; the breakdown is "
+                      << "not compared. Does it read PERFT_BREAKDOWN?" << Color::RESET << std::endl;
+        }
+    }
+
+public:
+    State(const Options& options)
+        : early_abort_(options.early_abort),
+          expect_hashes_(options.checksum && !is_plugin_path(options.user_engine_path)),
+          expect_breakdown_(options.breakdown && !is_plugin_path(options.user_engine_path)) {
+        if (!options.checkpoint_file.empty()) checkpoint_ = std::make_shared<Checkpoint>(options.checkpoint_file);
+
+        // Checksum and breakdown results are stored apart from plain counts, under their own ids.
+        std::string mode = std::string(options.checksum ? "+checksum" : "") + (options.breakdown ? "+breakdown" : "");
+        EngineId user_id = [path = options.user_engine_path, mode] { return user_engine_id(path) + mode; };
+        // A loaded library keeps answering after it is rebuilt, so its id is the one it was loaded with.
+        if (is_plugin_path(options.user_engine_path)) user_id = [id = user_engine_id(options.user_engine_path) + mode] { return id; };
+        EngineId reference_id = [id = options.reference + mode] { return id; };
+
+        // Queries are split by root move when there are several processes to spread
+        // them over, or when finished root moves have to be checkpointed.
+        std::vector<std::unique_ptr<Engine>> user_engines;
+        for (unsigned i = 0; i < options.fan_out; ++i) {
+            user_engines.push_back(make_user_engine(options.user_engine_path, options.persistent, options.checksum));
+        }
+        if (user_engines.size() > 1 || checkpoint_) {
+            user_engine_ = std::make_unique<FanOutEngine>(std::make_unique<EnginePool>(std::move(user_engines)), checkpoint_,
+                                                          user_id);
+        } else {
+            user_engine_ = std::move(user_engines.front());
+        }
+
+        pool_ = std::make_shared<WorkStealingPool>(options.threads);
+        if (options.use_cache) {
+            cache_ = std::make_shared<PerftCache>(options.cache_file);
+            user_engine_ = std::make_unique<CachedEngine>(std::move(user_engine_), cache_, user_id, false);
+        }
+
+        reference_name_ = options.reference == "builtin" ? "Reference" : "Stockfish";
+        auto make_reference = [options, pool = pool_, checkpoint = checkpoint_, cache = cache_, reference_id]() {
+            std::unique_ptr<Engine> engine;
+            std::unique_ptr<EnginePool> reference_pool;
+            if (options.reference == "builtin") {
+                engine = std::make_unique<BuiltinEngine>(pool, options.checksum, options.breakdown);
+            } else if (options.stockfish_pool > 1) {
+                reference_pool = make_stockfish_pool(options.stockfish_pool);
+            } else {
+                engine = std::make_unique<Stockfish>();
+            }
+            if (!reference_pool && checkpoint) {
+                std::vector<std::unique_ptr<Engine>> single;
+                single.push_back(std::move(engine));
+                reference_pool = std::make_unique<EnginePool>(std::move(single));
+            }
+            if (reference_pool) engine = std::make_unique<FanOutEngine>(std::move(reference_pool), checkpoint, reference_id);
+            // Checksums hash the move path, so transposed paths do not share them.
+            if (cache) engine = std::make_unique<CachedEngine>(std::move(engine), cache, reference_id, !options.checksum);
+            return engine;
+        };
+        if (options.golden_file.empty()) {
+            reference_engine_ = make_reference();
+        } else {
+            // Checked before the cache: the mapped database is the cheaper of the two. The
+            // reference behind it is only started on the first miss, so a machine without
+            // Stockfish can still use the database.
+            golden_ = std::make_shared<GoldenDb>(options.golden_file);
+            reference_engine_ = std::make_unique<GoldenEngine>(std::make_unique<LazyEngine>(make_reference), golden_);
+        }
+    }
+
+    PerftCache* cache() { return cache_.get(); }
+    GoldenDb* golden() { return golden_.get(); }
+    Engine& user_engine() { return *user_engine_; }
+    Engine& reference_engine() { return *reference_engine_; }
+    const std::string& reference_name() const { return reference_name_; }
+    unsigned threads() const { return static_cast<unsigned>(pool_->size()); }
+
+    void set_fen(std::string new_fen) { fen_ = std::move(new_fen); moves_.clear(); }
+    void set_depth(int d) { depth_ = d; }
+    void goto_root() { moves_.clear(); }
+    void goto_parent() { if (!moves_.empty()) moves_.pop_back(); }
+    void goto_child(const std::string& move) { moves_.push_back(move); }
+    void set_early_abort(bool enabled) { early_abort_ = enabled; }
+    bool early_abort() const { return early_abort_; }
+
+    const std::string& fen() const { return fen_; }
+    const std::vector<std::string>& moves() const { return moves_; }
+
+    int current_depth() const { return std::max(1, depth_ - static_cast<int>(moves_.size())); }
+
+    void print_position(int current_depth) const {
+        std::cout << "FEN: " << fen_ << std::endl;
+        std::cout << "Moves: ";
+        if(moves_.empty()) std::cout << "(none)";
+        else for(const auto& m : moves_) std::cout << m << " ";
+        std::cout << "\nDepth: " << current_depth << std::endl << std::endl;
+    }
+
+    // Both engines run concurrently, so a diff takes as long as the slower of the two.
+    // With a LiveDiff their root moves are matched up while they are still counting.
+    DiffResult compute_diff(const std::string& fen, const std::vector<std::string>& moves, int depth,
+                            LiveDiff* live = nullptr) {
+        auto user_future = user_engine_->run_perft_async(fen, moves, depth,
+                                                         live ? live->user_callback() : nullptr);
+        auto reference_future = reference_engine_->run_perft_async(fen, moves, depth,
+                                                                   live ? live->reference_callback() : nullptr);
+        PerftResult user_result = user_future.get();
+        PerftResult reference_result = reference_future.get();
+        warn_missing_details(user_result);
+        return DiffResult(user_result, reference_result);
+    }
+
+    DiffResult compute_diff(const std::vector<std::string>& moves, int depth, LiveDiff* live = nullptr) {
+        return compute_diff(fen_, moves, depth, live);
+    }
+
+    DiffResult compute_diff(int current_depth, LiveDiff* live = nullptr) { return compute_diff(moves_, current_depth, live); }
+
+    // Restores the position of the last diff recorded in the checkpoint file and runs
+    // it again; the root moves it had finished come from the checkpoint.
+    void resume() {
+        if (!checkpoint_) {
+            std::cerr << "Error: resume needs a checkpoint file (--checkpoint <path>)." << std::endl;
+            return;
+        }
+        auto run = checkpoint_->last_run();
+        if (!run) {
+            std::cout << "The checkpoint file holds no run to resume." << std::endl;
+            return;
+        }
+        fen_ = run->fen;
+        moves_ = run->moves;
+        depth_ = static_cast<int>(moves_.size()) + run->depth;
+        std::cout << "Resuming the last run." << std::endl;
+        run_diff();
+    }
+
+    // Rows are printed in the order both engines settle them. Moves only one engine
+    // produced can only be known at the end and follow, with the totals.
+    void run_diff() {
+        int current_depth = this->current_depth();
+        std::cout << "\n--- Running Perft ---\n";
+        print_position(current_depth);
+
+        if (checkpoint_) checkpoint_->start_run(fen_, moves_, current_depth);
+        LiveDiff live(early_abort_, true);
+        print_diff_header(LiveDiff::WIDTH, reference_name_);
+        DiffResult diff = compute_diff(current_depth, &live);
+
+        if (diff.crashed()) {
+            std::cout << "\n" << Color::PINK << describe_crash(diff, reference_name_) << "\nThe run is incomplete and was not cached."
+                      << Color::RESET << std::endl;
+            return;
+        }
+        if (diff.aborted) {
+            std::cout << "\n" << Color::ORANGE << "Stopped at the first mismatch (" << move_to_uci(*live.first_mismatch())
+                      << "); the rest of the run was cancelled." << Color::RESET << std::endl;
+            return;
+        }
+        std::vector<std::pair<std::string, const DiffEntry*>> unmatched;
+        for (const auto& entry : diff.moves) {
+            if (!entry.user || !entry.reference) unmatched.emplace_back(move_to_uci(entry.move), &entry);
+        }
+        std::sort(unmatched.begin(), unmatched.end());
+        for (const auto& row : unmatched) print_diff_row(row.first, row.second->user, row.second->reference, LiveDiff::WIDTH);
+        for (const auto& row : diff.unrecognised) print_diff_row(row.first, row.second, std::nullopt, LiveDiff::WIDTH);
+        print_diff_total(diff);
+    }
+
+    // Repeatedly diffs the current node and descends into the mismatched move with the
+    // smallest subtree until depth 1 is reached or the move lists themselves differ.
+    // The state is left at the diverging node so it can be inspected manually afterwards.
+    void run_autobisect() {
+        std::cout << "\n--- Running Auto-Bisect ---\n";
+        while (true) {
+            int current_depth = this->current_depth();
+            std::cout << "Depth " << current_depth << ": ";
+            if (moves_.empty()) std::cout << "(root)";
+            else for (const auto& m : moves_) std::cout << m << " ";
+            std::cout << std::endl;
+
+            // Any count mismatch is enough to descend, so with early abort both engines
+            // are stopped at the first one instead of finishing the node. Depth 1 is
+            // always run in full: its mismatches are missing or extra moves.
+            LiveDiff live(early_abort_ && current_depth > 1, false);
+            DiffResult diff = compute_diff(current_depth, &live);
+            if (diff.crashed()) {
+                // The crash itself is the bug to look at, so the state stays at this node.
+                std::cout << Color::PINK << describe_crash(diff, reference_name_) << Color::RESET << std::endl;
+                return;
+            }
+            if (diff.aborted) {
+                goto_child(move_to_uci(*live.first_mismatch()));
+                continue;
+            }
+
+            auto [missing, extra, next_move] = bisect_step(diff);
+            if (missing.empty() && extra.empty() && next_move.empty()) {
+                if (diff.total_nodes.first != diff.total_nodes.second) {
+                    std::cout << Color::ORANGE << "Per-move counts agree but totals differ. Check the engine's total line."
+                              << Color::RESET << std::endl;
+                } else {
+                    std::cout << "No mismatch found at this node." << std::endl;
+                }
+                return;
+            }
+
+            if (current_depth == 1 || !missing.empty() || !extra.empty()) {
+                std::cout << "\n--- First Divergence ---\n";
+                print_position(current_depth);
+                print_diff(diff, reference_name_);
+                std::cout << "\n";
+                if (!missing.empty()) {
+                    std::cout << Color::PINK << "Missing in your engine:";
+                    for (const auto& m : missing) std::cout << " " << m;
+                    std::cout << Color::RESET << std::endl;
+                }
+                if (!extra.empty()) {
+                    std::cout << Color::CYAN << "Extra in your engine:  ";
+                    for (const auto& m : extra) std::cout << " " << m;
+                    std::cout << Color::RESET << std::endl;
+                }
+                if (missing.empty() && extra.empty()) {
+                    std::cout << Color::ORANGE << "Move lists agree, but counts or details differ for: " << next_move
+                              << Color::RESET << std::endl;
+                }
+                std::cout << "Move path: ";
+                if (moves_.empty()) std::cout << "(none)";
+                else for (const auto& m : moves_) std::cout << m << " ";
+                std::cout << std::endl;
+                return;
+            }
+
+            goto_child(next_move);
+        }
+    }
+
+    // Perft cost grows about thirtyfold per ply, so the shallowest depth at which the
+    // engines disagree is found by diffing at 1, 2, 3 ... before paying for the set
+    // depth. The total depth is lowered to that depth and the bug is bisected there.
+    void run_mindepth() {
+        std::cout << "\n--- Searching Minimal Failing Depth ---\n";
+        int max_depth = current_depth();
+        for (int d = 1; d <= max_depth; ++d) {
+            LiveDiff live(early_abort_ && d > 1, false);
+            DiffResult diff = compute_diff(d, &live);
+            bool mismatch = diff.aborted || diff.crashed() || !diff.unrecognised.empty() ||
+                            diff.total_nodes.first != diff.total_nodes.second;
+            for (const auto& entry : diff.moves) {
+                mismatch = mismatch || !entry.user || !entry.reference || entry.subtree_differs();
+            }
+            std::cout << "Depth " << d << ": ";
+            if (!mismatch) {
+                std::cout << "match (" << diff.total_nodes.second << " nodes)" << std::endl;
+                continue;
+            }
+            std::cout << Color::ORANGE << "mismatch" << Color::RESET << std::endl;
+            depth_ = static_cast<int>(moves_.size()) + d;
+            std::cout << "Total depth set to " << depth_ << "." << std::endl;
+            run_autobisect();
+            return;
+        }
+        std::cout << "No mismatch up to depth " << max_depth << "." << std::endl;
+    }
+
+    // Key and FEN of the position reached from the base FEN by `path`. Transposed
+    // paths share the key; if the position cannot be replayed the path itself is used.
+    std::pair<std::string, std::string> position_at(const std::vector<std::string>& path) const {
+        Board board;
+        bool replayed = board.parse_fen(fen_);
+        for (const auto& move : path) replayed = replayed && board.apply_uci(move);
+        if (!replayed) {
+            std::string joined = fen_;
+            for (const auto& move : path) joined += " " + move;
+            return {joined, joined};
+        }
+        return {board.key(), board.fen()};
+    }
+
+    // Follows every mismatched subtree instead of a single path. The nodes of one
+    // level are diffed concurrently, every child whose counts differ is queued for the
+    // next level, and every node whose move lists differ is recorded, as is every
+    // depth 1 node whose checksums or breakdowns differ. Transpositions are merged, so
+    // each faulty position is checked and reported once.
+    void run_findall() {
+        struct Divergence {
+            std::string fen;
+            std::vector<std::string> path, missing, extra;
+            std::vector<std::pair<std::string, std::string>> details; // move and what differs below it, at depth 1
+            std::string crash;                                          // an engine failed here; nothing below is searched
+        };
+        std::cout << "\n--- Searching All Divergences ---\n";
+
+        std::vector<std::vector<std::string>> frontier{moves_};
+        std::unordered_set<std::string> reported;
+        std::vector<Divergence> found;
+        for (int depth = current_depth(); depth >= 1 && !frontier.empty(); --depth) {
+            std::vector<std::optional<DiffResult>> diffs(frontier.size());
+            std::atomic<size_t> next{0};
+            auto worker = [&]() {
+                for (size_t i = next++; i < frontier.size(); i = next++) diffs[i] = compute_diff(frontier[i], depth);
+            };
+            std::vector<std::future<void>> workers;
+            for (size_t i = 0; i < std::min(pool_->size(), frontier.size()); ++i) {
+                workers.push_back(std::async(std::launch::async, worker));
+            }
+            for (auto& w : workers) w.get();
+
+            std::vector<std::vector<std::string>> next_frontier;
+            std::unordered_set<std::string> queued;
+            size_t divergences_before = found.size();
+            for (size_t i = 0; i < frontier.size(); ++i) {
+                Divergence divergence;
+                // A crashed engine's move list is incomplete, so the node is reported as a crash.
+                divergence.crash = describe_crash(*diffs[i], reference_name_);
+                for (const auto& row : diffs[i]->unrecognised) divergence.extra.push_back(row.first);
+                for (const auto& entry : diffs[i]->moves) {
+                    if (!divergence.crash.empty()) break;
+                    std::string move = move_to_uci(entry.move);
+                    if (!entry.user) divergence.missing.push_back(move);
+                    else if (!entry.reference) divergence.extra.push_back(move);
+                    else if (entry.subtree_differs() && depth > 1) {
+                        std::vector<std::string> child = frontier[i];
+                        child.push_back(move);
+                        if (queued.insert(position_at(child).first).second) next_frontier.push_back(std::move(child));
+                    } else if (entry.subtree_differs()) {
+                        // Every count is 1 here, so only a checksum or breakdown can differ.
+                        divergence.details.emplace_back(move, entry.detail());
+                    }
+                }
+                if (divergence.missing.empty() && divergence.extra.empty() && divergence.details.empty() &&
+                    divergence.crash.empty()) continue;
+                auto position = position_at(frontier[i]);
+                if (!reported.insert(position.first).second) continue;
+                divergence.fen = position.second;
+                divergence.path = frontier[i];
+                found.push_back(std::move(divergence));
+            }
+            std::cout << "Depth " << depth << ": " << frontier.size() << " node(s) checked, "
+                      << found.size() - divergences_before << " divergence(s), "
+                      << next_frontier.size() << " mismatched child(ren)." << std::endl;
+            frontier = std::move(next_frontier);
+        }
+
+        if (found.empty()) {
+            std::cout << "No diverging positions found." << std::endl;
+            return;
+        }
+        std::cout << "\n--- " << found.size() << " Diverging Position(s) ---\n";
+        for (size_t i = 0; i < found.size(); ++i) {
+            const Divergence& d = found[i];
+            std::cout << "\n" << i + 1 << ". FEN: " << d.fen << std::endl;
+            std::cout << "   Move path: ";
+            if (d.path.empty()) std::cout << "(none)";
+            else for (const auto& m : d.path) std::cout << m << " ";
+            std::cout << std::endl;
+            if (!d.missing.empty()) {
+                std::cout << Color::PINK << "   Missing in your engine:";
+                for (const auto& m : d.missing) std::cout << " " << m;
+                std::cout << Color::RESET << std::endl;
+            }
+            if (!d.extra.empty()) {
+                std::cout << Color::CYAN << "   Extra in your engine:  ";
+                for (const auto& m : d.extra) std::cout << " " << m;
+                std::cout << Color::RESET << std::endl;
+            }
+            for (const auto& [move, detail] : d.details) {
+                std::cout << Color::ORANGE << "   Details differ for " << move << ": " << detail << Color::RESET << std::endl;
+            }
+            if (!d.crash.empty()) std::cout << Color::PINK << "   " << d.crash << Color::RESET << std::endl;
+        }
+    }
+};
+
+void print_help() {
+    std::cout << "\n--- Perft Debugger Commands ---\n"
+              << "diff          - Run comparison at the current position.\n"
+              << "resume        - Re-run the last diff from the checkpoint, skipping finished moves.\n"
+              << "autobisect    - Descend automatically to the first diverging move.\n"
+              << "mindepth      - Find the shallowest failing depth, then autobisect from it.\n"
+              << "findall       - Follow every mismatched subtree and list all diverging positions.\n"
+              << "depth <N>     - Set the total perft depth.\n"
+              << "fen <FEN>     - Set the board FEN. Clears current moves.\n"
+              << "move <m>      - Make a move (e.g., move e2e4).\n"
               << "unmove        - Go back one move.\n"
               << "root          - Return to the starting FEN, clear all moves.\n"
+              << "cache [clear] - Show result cache and golden database statistics, or empty the cache.\n"
+              << "bench [runs]  - Time both engines on the standard positions. Starts its own engines:\n"
+              << "                no cache, golden database, --fan-out or --sf-pool.\n"
+              << "minimize      - Shrink the failing position to a small reproducer and load it.\n"
+              << "fuzz [secs] [depth]\n"
+              << "              - Diff random positions from playouts for a while (default 30 s, depth 2).\n"
+              << "stats [csv|json <file> | clear]\n"
+              << "              - Show per-query timings, export them, or reset them.\n"
+              << "abort on|off  - Stop both engines at the first mismatching move.\n"
               << "help          - Show this help message.\n"
               << "exit / quit   - Close the debugger.\n"
               << std::endl;
 }
 
+// =================================================================================
+// ================================ EPD Suite Runner ===============================
+// =================================================================================
+
+struct SuiteCase {
+    size_t position = 0; // 1-based line of the position in the suite
+    std::string fen;
+    int depth = 0;
+    long long expected = 0;
+};
+
+// Reads lines of the form "<fen> ;D1 20 ;D2 400 ;D3 8902". FENs with only four fields
+// get "0 1" move counters appended. Depths above max_depth (if positive) are skipped.
+std::vector<SuiteCase> load_epd_suite(const std::string& path, int max_depth) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Cannot open suite file '" + path + "'");
+
+    std::vector<SuiteCase> cases;
+    std::string line;
+    size_t position = 0;
+    while (std::getline(in, line)) {
+        size_t semicolon = line.find(';');
+        std::string fen = line.substr(0, semicolon);
+        fen.erase(fen.find_last_not_of(" \t\r") + 1);
+        fen.erase(0, fen.find_first_not_of(" \t"));
+        if (fen.empty() || fen[0] == '#') continue;
+        ++position;
+
+        std::stringstream fields(fen);
+        std::string field;
+        int field_count = 0;
+        while (fields >> field) ++field_count;
+        if (field_count == 4) fen += " 0 1";
+
+        while (semicolon != std::string::npos) {
+            size_t next = line.find(';', semicolon + 1);
+            std::stringstream entry(line.substr(semicolon + 1, next == std::string::npos ? std::string::npos : next - semicolon - 1));
+            std::string tag;
+            long long expected;
+            if (entry >> tag >> expected && tag.size() > 1 && tag[0] == 'D') {
+                int depth = std::atoi(tag.c_str() + 1);
+                if (depth > 0 && (max_depth <= 0 || depth <= max_depth)) {
+                    cases.push_back({position, fen, depth, expected});
+                }
+            }
+            semicolon = next;
+        }
+    }
+    return cases;
+}
+
+// Runs every (position, depth) of an EPD suite through the user engine on a worker
+// pool and checks the totals against the expected counts. No reference engine is
+// involved. Returns the process exit code: 0 if everything passed.
+int run_suite(const Options& options) {
+    std::vector<SuiteCase> cases = load_epd_suite(options.suite_file, options.suite_depth);
+    if (cases.empty()) {
+        std::cerr << "Error: no '<fen> ;D<n> <count>' entries in '" << options.suite_file << "'." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Engine>> engines;
+    for (unsigned i = 0; i < options.threads; ++i) {
+        engines.push_back(make_user_engine(options.user_engine_path, options.persistent));
+    }
+    EnginePool engine(std::move(engines));
+    WorkStealingPool pool(options.threads);
+
+    struct Outcome {
+        long long nodes = 0;
+        double seconds = 0;
+        std::string crash;
+    };
+    // Deepest cases first, so the long ones do not end up as the tail of the run.
+    std::vector<size_t> order(cases.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return cases[a].depth > cases[b].depth; });
+
+    std::vector<std::future<Outcome>> futures(cases.size());
+    auto suite_start = std::chrono::steady_clock::now();
+    for (size_t i : order) {
+        const SuiteCase& c = cases[i];
+        futures[i] = pool.submit([&engine, &c] {
+            auto start = std::chrono::steady_clock::now();
+            PerftResult result = engine.run_perft(c.fen, {}, c.depth);
+            Outcome outcome;
+            outcome.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            outcome.nodes = result.total_nodes;
+            outcome.crash = result.crash;
+            return outcome;
+        });
+    }
+
+    std::cout << std::left << std::setw(6) << "Pos" << std::setw(7) << "Depth"
+              << std::right << std::setw(16) << "Expected" << std::setw(16) << "YourEngine"
+              << std::setw(10) << "Time(s)" << std::setw(12) << "Nodes/s" << "  Result" << std::endl;
+
+    size_t failed = 0;
+    long long total_nodes = 0;
+    std::vector<size_t> failed_positions;
+    for (size_t i = 0; i < cases.size(); ++i) {
+        const SuiteCase& c = cases[i];
+        Outcome outcome = futures[i].get();
+        bool pass = outcome.nodes == c.expected && outcome.crash.empty();
+        total_nodes += outcome.nodes;
+        if (!pass) {
+            ++failed;
+            if (failed_positions.empty() || failed_positions.back() != c.position) failed_positions.push_back(c.position);
+        }
+        long long nps = outcome.seconds > 0 ? static_cast<long long>(outcome.nodes / outcome.seconds) : 0;
+
+        if (!pass) std::cout << Color::ORANGE;
+        std::cout << std::left << std::setw(6) << c.position << std::setw(7) << c.depth
+                  << std::right << std::setw(16) << c.expected << std::setw(16) << outcome.nodes
+                  << std::setw(10) << std::fixed << std::setprecision(3) << outcome.seconds
+                  << std::setw(12) << nps << "  " << (pass ? "PASS" : outcome.crash.empty() ? "FAIL" : "CRASH: " + outcome.crash)
+                  << std::endl;
+        if (!pass) std::cout << Color::RESET;
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - suite_start).count();
+    std::cout << "\n" << (cases.size() - failed) << "/" << cases.size() << " passed in "
+              << std::fixed << std::setprecision(2) << elapsed << "s ("
+              << static_cast<long long>(elapsed > 0 ? total_nodes / elapsed : 0) << " nodes/s on "
+              << options.threads << " workers)." << std::endl;
+    for (size_t position : failed_positions) {
+        auto it = std::find_if(cases.begin(), cases.end(), [&](const SuiteCase& c) { return c.position == position; });
+        std::cout << Color::ORANGE << "Failed position " << position << ": " << it->fen << Color::RESET << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+// =================================================================================
+// ================================== Benchmark ====================================
+// =================================================================================
+
+struct BenchPosition {
+    const char* name;
+    const char* fen;
+    int depth;
+};
+
+// The standard chessprogramming perft positions, at depths of a few million nodes.
+const BenchPosition BENCH_POSITIONS[] = {
+    {"startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5},
+    {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4},
+    {"position3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6},
+    {"position4", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5},
+    {"position5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4},
+    {"position6", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4},
+};
+
+double median(std::vector<double> values) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Median absolute deviation: a spread measure that one noisy run cannot inflate.
+double median_abs_deviation(const std::vector<double>& values) {
+    double center = median(values);
+    std::vector<double> deviations;
+    for (double v : values) deviations.push_back(std::fabs(v - center));
+    return median(deviations);
+}
+
+// Two-sided p-value of the Mann-Whitney U test (normal approximation with tie
+// correction). It makes no assumption about the shape of the timing distribution.
+double mann_whitney_p(const std::vector<double>& a, const std::vector<double>& b) {
+    std::vector<std::pair<double, int>> all;
+    for (double v : a) all.emplace_back(v, 0);
+    for (double v : b) all.emplace_back(v, 1);
+    std::sort(all.begin(), all.end());
+
+    double rank_sum_a = 0, tie_term = 0;
+    for (size_t i = 0; i < all.size(); ) {
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) ++j;
+        double rank = (i + 1 + j) / 2.0;
+        for (size_t k = i; k < j; ++k) if (all[k].second == 0) rank_sum_a += rank;
+        double t = static_cast<double>(j - i);
+        tie_term += t * t * t - t;
+        i = j;
+    }
+
+    double n1 = static_cast<double>(a.size()), n2 = static_cast<double>(b.size()), n = n1 + n2;
+    double u = rank_sum_a - n1 * (n1 + 1) / 2;
+    double sigma = std::sqrt(n1 * n2 / 12.0 * ((n + 1) - tie_term / (n * (n - 1))));
+    if (sigma == 0) return 1.0;
+    double z = (u - n1 * n2 / 2) / sigma;
+    return std::erfc(std::fabs(z) / std::sqrt(2.0));
+}
+
+struct BenchEngine {
+    std::string name;
+    std::string label;
+    std::unique_ptr<Engine> engine;
+    std::vector<std::vector<double>> seconds;   // [position][run]
+    std::vector<long long> nodes;               // [position]
+    std::vector<double> run_seconds;            // whole position set, per run
+};
+
+// Times the user engine, the reference and optionally a second user engine build on
+// the standard positions. Runs are interleaved between engines so that machine noise
+// hits all of them alike. Returns 1 if any engine disagreed with the reference.
+// The engines are started here, also from the prompt: a session's engines sit behind
+// the cache and golden database, which would answer every run after the first.
+int run_bench(const Options& options, int runs) {
+    std::vector<BenchEngine> engines;
+    engines.push_back({"user", options.user_engine_path, make_user_engine(options.user_engine_path, options.persistent), {}, {}, {}});
+    if (!options.bench_against.empty()) {
+        engines.push_back({"against", options.bench_against, make_user_engine(options.bench_against, options.persistent), {}, {}, {}});
+    }
+    std::unique_ptr<Engine> reference;
+    if (options.reference == "builtin") reference = std::make_unique<BuiltinEngine>(std::make_shared<WorkStealingPool>(options.threads));
+    else reference = std::make_unique<Stockfish>();
+    engines.push_back({"reference", options.reference, std::move(reference), {}, {}, {}});
+
+    const size_t position_count = std::size(BENCH_POSITIONS);
+    for (auto& e : engines) {
+        e.seconds.assign(position_count, {});
+        e.nodes.assign(position_count, 0);
+        e.engine->run_perft(BENCH_POSITIONS[0].fen, {}, 1); // warm-up: process start, tables
+    }
+
+    std::cout << "\n--- Running Benchmark (" << runs << " runs) ---\n";
+    for (int run = 0; run < runs; ++run) {
+        std::cout << "Run " << (run + 1) << "/" << runs << "..." << std::endl;
+        for (auto& e : engines) {
+            double total = 0;
+            for (size_t p = 0; p < position_count; ++p) {
+                auto start = std::chrono::steady_clock::now();
+                PerftResult result = e.engine->run_perft(BENCH_POSITIONS[p].fen, {}, BENCH_POSITIONS[p].depth);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                e.seconds[p].push_back(seconds);
+                e.nodes[p] = result.total_nodes;
+                total += seconds;
+            }
+            e.run_seconds.push_back(total);
+        }
+    }
+
+    const BenchEngine& truth = engines.back();
+    bool all_correct = true;
+    std::cout << "\n" << std::left << std::setw(11) << "Engine" << std::setw(11) << "Position"
+              << std::right << std::setw(12) << "Nodes" << std::setw(11) << "Median(s)"
+              << std::setw(9) << "MAD%" << std::setw(13) << "Nodes/s" << std::endl;
+    for (const auto& e : engines) {
+        long long total_nodes = 0;
+        double total_median = 0;
+        for (size_t p = 0; p < position_count; ++p) {
+            double med = median(e.seconds[p]);
+            bool correct = e.nodes[p] == truth.nodes[p];
+            all_correct = all_correct && correct;
+            total_nodes += e.nodes[p];
+            total_median += med;
+            if (!correct) std::cout << Color::ORANGE;
+            std::cout << std::left << std::setw(11) << e.name << std::setw(11) << BENCH_POSITIONS[p].name
+                      << std::right << std::setw(12) << e.nodes[p]
+                      << std::setw(11) << std::fixed << std::setprecision(3) << med
+                      << std::setw(9) << std::setprecision(1) << (med > 0 ? 100 * median_abs_deviation(e.seconds[p]) / med : 0)
+                      << std::setw(13) << static_cast<long long>(med > 0 ? e.nodes[p] / med : 0)
+                      << (correct ? "" : "  WRONG") << std::endl;
+            if (!correct) std::cout << Color::RESET;
+        }
+        std::cout << std::left << std::setw(11) << e.name << std::setw(11) << "total"
+                  << std::right << std::setw(12) << total_nodes
+                  << std::setw(11) << std::setprecision(3) << total_median << std::setw(9) << ""
+                  << std::setw(13) << static_cast<long long>(total_median > 0 ? total_nodes / total_median : 0) << "\n" << std::endl;
+    }
+
+    double speedup = 0, p_value = 1;
+    if (engines.size() == 3) {
+        const auto& a = engines[0];
+        const auto& b = engines[1];
+        speedup = median(a.run_seconds) / median(b.run_seconds);
+        p_value = mann_whitney_p(a.run_seconds, b.run_seconds);
+        std::cout << "A/B: '" << b.label << "' is " << std::setprecision(1) << 100 * std::fabs(speedup - 1) << "% "
+                  << (speedup >= 1 ? "faster" : "slower") << " than '" << a.label << "' (median of "
+                  << runs << " runs), p = " << std::setprecision(4) << p_value;
+        if (runs < 5) std::cout << " (too few runs for a meaningful test, use at least 5)";
+        else std::cout << (p_value < 0.05 ? " - significant." : " - not significant.");
+        std::cout << std::endl;
+    }
+    if (!all_correct) {
+        std::cout << Color::ORANGE << "Some node counts differ from the reference." << Color::RESET << std::endl;
+    }
+
+    if (!options.bench_json.empty()) {
+        std::ofstream out(options.bench_json);
+        if (!out) {
+            std::cerr << "Error: cannot write '" << options.bench_json << "'." << std::endl;
+        } else {
+            out << std::setprecision(9) << "{\n  \"runs\": " << runs << ",\n  \"engines\": [\n";
+            for (size_t i = 0; i < engines.size(); ++i) {
+                const auto& e = engines[i];
+                out << "    {\"name\": \"" << e.name << "\", \"label\": \"" << json_escape(e.label) << "\", \"positions\": [\n";
+                for (size_t p = 0; p < position_count; ++p) {
+                    double med = median(e.seconds[p]);
+                    out << "      {\"name\": \"" << BENCH_POSITIONS[p].name << "\", \"fen\": \"" << BENCH_POSITIONS[p].fen
+                        << "\", \"depth\": " << BENCH_POSITIONS[p].depth << ", \"nodes\": " << e.nodes[p]
+                        << ", \"correct\": " << (e.nodes[p] == truth.nodes[p] ? "true" : "false")
+                        << ", \"median_seconds\": " << med << ", \"mad_seconds\": " << median_abs_deviation(e.seconds[p])
+                        << ", \"nps\": " << (med > 0 ? e.nodes[p] / med : 0) << ", \"seconds\": [";
+                    for (size_t r = 0; r < e.seconds[p].size(); ++r) out << (r ? ", " : "") << e.seconds[p][r];
+                    out << "]}" << (p + 1 < position_count ? "," : "") << "\n";
+                }
+                out << "    ], \"run_seconds\": [";
+                for (size_t r = 0; r < e.run_seconds.size(); ++r) out << (r ? ", " : "") << e.run_seconds[r];
+                out << "]}" << (i + 1 < engines.size() ? "," : "") << "\n";
+            }
+            out << "  ]";
+            if (engines.size() == 3) {
+                out << ",\n  \"comparison\": {\"a\": \"" << json_escape(engines[0].label) << "\", \"b\": \""
+                    << json_escape(engines[1].label) << "\", \"speedup\": " << speedup << ", \"p_value\": " << p_value
+                    << ", \"significant\": " << (runs >= 5 && p_value < 0.05 ? "true" : "false") << "}";
+            }
+            out << "\n}\n";
+            std::cout << "Results written to " << options.bench_json << "." << std::endl;
+        }
+    }
+    return all_correct ? 0 : 1;
+}
+
+// =================================================================================
+// ===================================== Fuzzer ====================================
+// =================================================================================
+
+struct FuzzFinding {
+    std::string fen;                // position where the engines disagree
+    std::string seed;
+    std::vector<std::string> path;  // moves from the seed
+    std::string summary;
+};
+
+// One line describing how a diff disagrees, or empty if it does not.
+std::string describe_mismatch(const DiffResult& diff) {
+    if (diff.crashed()) return describe_crash(diff, "Reference");
+    std::string missing, extra, counts, details;
+    for (const auto& row : diff.unrecognised) extra += " " + row.first;
+    for (const auto& entry : diff.moves) {
+        std::string move = " " + move_to_uci(entry.move);
+        if (!entry.user) missing += move;
+        else if (!entry.reference) extra += move;
+        else if (*entry.user != *entry.reference) counts += move;
+        else if (!entry.detail().empty()) details += move + " (" + entry.detail() + ")";
+    }
+    std::string summary;
+    if (!missing.empty()) summary += "missing" + missing + "; ";
+    if (!extra.empty()) summary += "extra" + extra + "; ";
+    if (!counts.empty()) summary += "counts differ for" + counts + "; ";
+    if (!details.empty()) summary += "details differ for" + details + "; ";
+    if (summary.empty() && diff.total_nodes.first != diff.total_nodes.second) summary = "totals differ; ";
+    if (!summary.empty()) summary.resize(summary.size() - 2);
+    return summary;
+}
+
+// Random walks from the seed positions, one per worker thread. Every position on a
+// walk gets a shallow diff, and one of the reference's root moves, picked at random,
+// leads to the next. A walk restarts from a random seed after a mate, a stalemate
+// or MAX_PLIES moves. Runs until the time budget is spent; each disagreeing
+// position is reported once. Seeds with an invalid FEN are skipped.
+void run_fuzz(State& state, const std::vector<std::string>& candidates, double seconds, int depth) {
+    constexpr size_t MAX_PLIES = 80;
+    std::vector<std::string> seeds;
+    for (const auto& fen : candidates) {
+        Board board;
+        if (board.parse_fen(fen)) seeds.push_back(fen);
+        else std::cerr << Color::ORANGE << "Warning: skipping seed with an invalid FEN: " << fen << Color::RESET << std::endl;
+    }
+    if (seeds.empty()) {
+        std::cerr << "Error: no valid seed position to fuzz from." << std::endl;
+        return;
+    }
+    std::cout << "\n--- Fuzzing " << seeds.size() << " seed position(s) at depth " << depth << " for " << seconds
+              << " s on " << state.threads() << " worker(s) ---\n";
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    std::atomic<long long> positions{0};
+    std::mutex mutex;
+    std::unordered_set<std::string> seen;
+    std::vector<FuzzFinding> findings;
+
+    auto worker = [&](unsigned index) {
+        std::mt19937_64 rng(std::random_device{}() ^ (static_cast<uint64_t>(index) << 32));
+        while (std::chrono::steady_clock::now() < deadline) {
+            const std::string& seed = seeds[rng() % seeds.size()];
+            Board board;
+            board.parse_fen(seed);
+            std::vector<std::string> path;
+            size_t plies = 1 + rng() % MAX_PLIES;
+            while (path.size() < plies && std::chrono::steady_clock::now() < deadline) {
+                DiffResult diff = state.compute_diff(seed, path, depth);
+                ++positions;
+                std::string summary = describe_mismatch(diff);
+                if (!summary.empty()) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (seen.insert(board.key()).second) {
+                        findings.push_back({board.fen(), seed, path, summary});
+                        std::cout << Color::ORANGE << "Mismatch " << findings.size() << ": " << board.fen()
+                                  << Color::RESET << "\n    " << summary << std::endl;
+                    }
+                }
+
+                std::vector<Move> choices;
+                for (const auto& entry : diff.moves) {
+                    if (entry.reference) choices.push_back(entry.move);
+                }
+                if (choices.empty()) break;
+                Move next = choices[rng() % choices.size()];
+                if (!board.apply_legal_uci(move_to_uci(next))) break;
+                path.push_back(move_to_uci(next));
+            }
+        }
+    };
+    std::vector<std::future<void>> workers;
+    for (unsigned i = 0; i < state.threads(); ++i) workers.push_back(std::async(std::launch::async, worker, i));
+    for (auto& w : workers) w.get();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "\nTested " << positions << " positions in " << std::fixed << std::setprecision(1) << elapsed << " s ("
+              << positions / std::max(elapsed, 1e-9) << " per second)." << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+    if (findings.empty()) {
+        std::cout << "No disagreements found." << std::endl;
+        return;
+    }
+    std::cout << findings.size() << " disagreeing position(s):" << std::endl;
+    for (size_t i = 0; i < findings.size(); ++i) {
+        const FuzzFinding& f = findings[i];
+        std::cout << "\n" << i + 1 << ". FEN: " << f.fen << "\n   Seed: " << f.seed << "\n   Move path: ";
+        if (f.path.empty()) std::cout << "(none)";
+        else for (const auto& m : f.path) std::cout << m << " ";
+        std::cout << "\n   " << f.summary << std::endl;
+    }
+}
+
+// =================================================================================
+// ==================================== Minimizer ==================================
+// =================================================================================
+
+// Both kings present, the side that just moved not left in check, and no more than
+// two checkers: positions any engine and Stockfish can be expected to handle.
+bool is_plausible(const Board& board) {
+    int our_king = board.king_square(board.side);
+    int their_king = board.king_square(board.side ^ 1);
+    if (our_king == NO_SQUARE || their_king == NO_SQUARE) return false;
+    if (board.attackers_to(their_king, board.all()) & board.occupied[board.side]) return false;
+    return popcount(board.checkers()) <= 2;
+}
+
+// Shrinks the position at the current node while the engines keep disagreeing on
+// it at the same or a lower depth. It first starts the position as late on the
+// move path as possible, then removes pieces one at a time (kings excepted) and
+// drops castling rights and the en passant square, until nothing more can go.
+// The smallest reproducer found is loaded as the new position.
+void run_minimize(State& state) {
+    std::cout << "\n--- Minimising Failing Position ---\n";
+    size_t queries = 0;
+    // The shallowest depth up to `limit` at which the engines disagree, or 0.
+    auto failing_depth = [&](const std::string& fen, const std::vector<std::string>& moves, int limit) {
+        for (int d = 1; d <= limit; ++d) {
+            ++queries;
+            if (!describe_mismatch(state.compute_diff(fen, moves, d)).empty()) return d;
+        }
+        return 0;
+    };
+    // Replays `moves` from `fen`, filling `positions` with the FEN before each move
+    // and the final one. False if a move is illegal there.
+    auto replay = [](const std::string& fen, const std::vector<std::string>& moves, std::vector<std::string>& positions) {
+        Board board;
+        if (!board.parse_fen(fen)) return false;
+        positions = {board.fen()};
+        for (const auto& move : moves) {
+            if (!board.apply_legal_uci(move)) return false;
+            positions.push_back(board.fen());
+        }
+        return true;
+    };
+
+    std::string fen = state.fen();
+    std::vector<std::string> moves = state.moves();
+    int depth = failing_depth(fen, moves, state.current_depth());
+    if (depth == 0) {
+        std::cout << "The engines agree here up to depth " << state.current_depth() << "; nothing to minimise." << std::endl;
+        return;
+    }
+    std::vector<std::string> positions;
+    if (!replay(fen, moves, positions)) {
+        std::cerr << "Error: the move path cannot be replayed from the FEN." << std::endl;
+        return;
+    }
+    auto report = [&](const std::string& what) {
+        Board board;
+        board.parse_fen(fen);
+        std::cout << std::left << std::setw(28) << what << std::right << std::setw(3) << popcount(board.all())
+                  << " pieces, " << moves.size() << " move(s), depth " << depth << std::endl;
+    };
+    report("Start:");
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // A later start on the path means fewer moves to replay.
+        for (size_t k = moves.size(); k > 0; --k) {
+            std::vector<std::string> rest(moves.begin() + k, moves.end());
+            if (int d = failing_depth(positions[k], rest, depth)) {
+                fen = positions[k];
+                moves = rest;
+                depth = d;
+                replay(fen, moves, positions);
+                report("Started " + std::to_string(k) + " move(s) later:");
+                changed = true;
+                break;
+            }
+        }
+
+        Board board;
+        board.parse_fen(fen);
+        auto try_candidate = [&](Board candidate, const std::string& what) {
+            candidate = candidate.normalised();
+            std::vector<std::string> candidate_positions;
+            if (!is_plausible(candidate) || !replay(candidate.fen(), moves, candidate_positions)) return false;
+            int d = failing_depth(candidate.fen(), moves, depth);
+            if (d == 0) return false;
+            board = candidate;
+            fen = candidate.fen();
+            positions = std::move(candidate_positions);
+            depth = d;
+            report(what);
+            return true;
+        };
+
+        for (int sq = 0; sq < 64; ++sq) {
+            int piece = board.mailbox[sq];
+            if (piece == NO_PIECE || piece_type(piece) == KING) continue;
+            Board candidate = board;
+            candidate.remove_piece(sq);
+            changed |= try_candidate(candidate, std::string("Removed ") + "PNBRQKpnbrqk"[piece] + " on " + square_name(sq) + ":");
+        }
+        for (int right : {WHITE_OO, WHITE_OOO, BLACK_OO, BLACK_OOO}) {
+            if (!(board.castling & right)) continue;
+            Board candidate = board;
+            candidate.castling &= ~right;
+            changed |= try_candidate(candidate, "Dropped a castling right:");
+        }
+        if (board.ep_square != NO_SQUARE) {
+            Board candidate = board;
+            candidate.ep_square = NO_SQUARE;
+            changed |= try_candidate(candidate, "Dropped the en passant square:");
+        }
+    }
+
+    std::cout << "\nSmallest reproducer (" << queries << " diffs tried):\n"
+              << "FEN:   " << fen << "\nMoves: ";
+    if (moves.empty()) std::cout << "(none)";
+    else for (const auto& m : moves) std::cout << m << " ";
+    std::cout << "\nDepth: " << depth << std::endl;
+
+    state.set_fen(fen);
+    for (const auto& m : moves) state.goto_child(m);
+    state.set_depth(static_cast<int>(moves.size()) + depth);
+    std::cout << "Loaded as the current position." << std::endl;
+}
+
+// =================================================================================
+// ============================ Golden Database Builder ============================
+// =================================================================================
+
+// Small positions around the rules engines most often get wrong: en passant that
+// exposes the king, castling through or into check, promotions, stalemate.
+const BenchPosition GOLDEN_TRAP_POSITIONS[] = {
+    {"illegal-ep-1", "3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1", 6},
+    {"illegal-ep-2", "8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1", 6},
+    {"ep-gives-check", "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", 6},
+    {"short-castle-check", "5k2/8/8/8/8/8/8/4K2R w K - 0 1", 6},
+    {"long-castle-check", "3k4/8/8/8/8/8/8/R3K3 w Q - 0 1", 6},
+    {"castle-rights", "r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1", 4},
+    {"castle-prevented", "r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1", 4},
+    {"promote-out-of-check", "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", 6},
+    {"discovered-check", "8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1", 5},
+    {"promote-check", "4k3/1P6/8/8/8/8/K7/8 w - - 0 1", 6},
+    {"underpromote-check", "8/P1k5/K7/8/8/8/8/8 w - - 0 1", 6},
+    {"self-stalemate", "K1k5/8/P7/8/8/8/8/8 w - - 0 1", 6},
+    {"stalemate-mate-1", "8/k1P5/8/1K6/8/8/8/8 w - - 0 1", 7},
+    {"stalemate-mate-2", "8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1", 4},
+};
+
+std::unique_ptr<Engine> make_golden_oracle(const Options& options) {
+    if (options.golden_oracle == "builtin") {
+        return std::make_unique<BuiltinEngine>(std::make_shared<WorkStealingPool>(options.threads));
+    }
+    if (options.golden_oracle == "stockfish") return make_stockfish_pool(options.threads);
+    std::vector<std::unique_ptr<Engine>> engines;
+    for (unsigned i = 0; i < options.threads; ++i) engines.push_back(make_user_engine(options.golden_oracle, options.persistent));
+    return std::make_unique<EnginePool>(std::move(engines));
+}
+
+// Queries the oracle for every depth up to each position's depth, and for the
+// positions up to `golden_plies` moves below it at the correspondingly lower depths.
+// Positions reached by several paths are queried once.
+int run_golden_build(const Options& options) {
+    std::vector<std::pair<std::string, int>> roots;
+    if (!options.suite_file.empty()) {
+        for (const auto& c : load_epd_suite(options.suite_file, options.suite_depth)) {
+            if (!roots.empty() && roots.back().first == c.fen) roots.back().second = std::max(roots.back().second, c.depth);
+            else roots.emplace_back(c.fen, c.depth);
+        }
+    } else {
+        for (const auto& position : BENCH_POSITIONS) roots.emplace_back(position.fen, position.depth);
+        for (const auto& position : GOLDEN_TRAP_POSITIONS) roots.emplace_back(position.fen, position.depth);
+    }
+    if (roots.empty()) {
+        std::cerr << "Error: no positions to build the golden database from." << std::endl;
+        return 1;
+    }
+
+    struct Job {
+        std::string fen;
+        std::vector<std::string> moves;
+        int depth;
+        uint64_t key;
+        int legal_moves;
+    };
+    std::vector<Job> jobs;
+    std::set<std::pair<uint64_t, int>> queued;
+    for (const auto& [fen, root_depth] : roots) {
+        Board root;
+        if (!root.parse_fen(fen)) {
+            std::cerr << "Error: invalid FEN '" << fen << "'." << std::endl;
+            return 1;
+        }
+        int depth = options.golden_depth > 0 ? options.golden_depth : root_depth;
+        std::vector<std::pair<Board, std::vector<std::string>>> level{{root, {}}};
+        for (int ply = 0; ply <= options.golden_plies && ply < depth; ++ply) {
+            std::vector<std::pair<Board, std::vector<std::string>>> next;
+            for (const auto& [board, path] : level) {
+                MoveList list;
+                board.generate_legal(list);
+                uint64_t key = golden_key(board);
+                for (int d = 1; d <= depth - ply; ++d) {
+                    if (queued.insert({key, d}).second) jobs.push_back({fen, path, d, key, list.size});
+                }
+                if (ply == options.golden_plies) continue;
+                for (int i = 0; i < list.size; ++i) {
+                    next.emplace_back(board, path);
+                    next.back().first.make_move(list.moves[i]);
+                    next.back().second.push_back(move_to_uci(list.moves[i]));
+                }
+            }
+            level = std::move(next);
+        }
+    }
+    // Deepest first, so the long queries do not end up as the tail of the run.
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.depth > b.depth; });
+
+    std::cout << "Building '" << options.golden_build << "' from " << options.golden_oracle << ": " << roots.size()
+              << " positions, " << jobs.size() << " queries." << std::endl;
+    std::unique_ptr<Engine> oracle = make_golden_oracle(options);
+    std::map<std::pair<uint64_t, int>, PerftResult> entries;
+    std::mutex entries_mutex;
+    std::atomic<size_t> next_job{0}, done{0};
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&] {
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            const Job& job = jobs[i];
+            PerftResult result = oracle->run_perft(job.fen, job.moves, job.depth);
+            std::lock_guard<std::mutex> lock(entries_mutex);
+            // A crashed oracle answers with nothing; only a mated or stalemated side has no moves.
+            size_t reported = result.moves.size() + result.unrecognised.size();
+            if (!result.complete() || static_cast<int>(reported) != job.legal_moves || !result.unrecognised.empty()) {
+                if (error.empty()) {
+                    error = result.crash.empty() ? "the oracle reported " + std::to_string(reported) +
+                                                       " moves instead of " + std::to_string(job.legal_moves)
+                                                 : "the oracle crashed (" + result.crash + ")";
+                    error += " for '" + job.fen + "' moves:";
+                    for (const auto& move : job.moves) error += " " + move;
+                }
+                next_job = jobs.size();
+                return;
+            }
+            entries[{job.key, job.depth}] = std::move(result);
+            if (IS_TTY) std::cout << "\r" << ++done << "/" << jobs.size() << " queries" << std::flush;
+        }
+    };
+    std::vector<std::future<void>> workers;
+    for (unsigned i = 0; i < std::max(1u, options.threads); ++i) workers.push_back(std::async(std::launch::async, worker));
+    for (auto& w : workers) w.get();
+    if (IS_TTY) std::cout << "\r";
+    if (!error.empty()) {
+        std::cerr << Color::ORANGE << "Error: " << error << Color::RESET << std::endl;
+        return 1;
+    }
+
+    GoldenDb::write(options.golden_build, entries);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << entries.size() << " entries to '" << options.golden_build << "' in " << std::fixed
+              << std::setprecision(2) << elapsed << "s." << std::endl;
+    return 0;
+}
+
+// =================================================================================
+// =============================== JSON-Lines Server ===============================
+// =================================================================================
+
+// Just enough JSON for server requests: one object per line, whose values are
+// strings, numbers, booleans, null or arrays of these.
+struct JsonValue {
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY } type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string text;
+    std::vector<JsonValue> items;
+};
+
+class JsonParser {
+private:
+    std::string_view in_;
+    size_t pos_ = 0;
+
+    explicit JsonParser(std::string_view in) : in_(in) {}
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("invalid JSON: " + what + " at offset " + std::to_string(pos_));
+    }
+
+    void skip_space() {
+        while (pos_ < in_.size() && std::isspace(static_cast<unsigned char>(in_[pos_]))) ++pos_;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos_ < in_.size() && in_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) fail(std::string("expected '") + c + "'");
+    }
+
+    std::string parse_string() {
+        expect('"');
+        std::string out;
+        while (pos_ < in_.size() && in_[pos_] != '"') {
+            char c = in_[pos_++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= in_.size()) break;
+            switch (char e = in_[pos_++]) {
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    unsigned code = 0;
+                    auto [end, error] = std::from_chars(in_.data() + pos_, in_.data() + std::min(pos_ + 4, in_.size()), code, 16);
+                    if (error != std::errc() || end != in_.data() + pos_ + 4) fail("bad \\u escape");
+                    pos_ += 4;
+                    // Surrogate pairs are not combined; FENs and moves are ASCII anyway.
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xC0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        out += static_cast<char>(0xE0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += e; break; // \" \\ \/
+            }
+        }
+        if (pos_ >= in_.size()) fail("unterminated string");
+        ++pos_;
+        return out;
+    }
+
+    JsonValue parse_value() {
+        skip_space();
+        JsonValue value;
+        if (pos_ >= in_.size()) fail("unexpected end");
+        char c = in_[pos_];
+        if (c == '"') {
+            value.type = JsonValue::STRING;
+            value.text = parse_string();
+        } else if (c == '[') {
+            value.type = JsonValue::ARRAY;
+            ++pos_;
+            if (consume(']')) return value;
+            do value.items.push_back(parse_value()); while (consume(','));
+            expect(']');
+        } else if (in_.substr(pos_, 4) == "true" || in_.substr(pos_, 5) == "false") {
+            value.type = JsonValue::BOOLEAN;
+            value.boolean = c == 't';
+            pos_ += value.boolean ? 4 : 5;
+        } else if (in_.substr(pos_, 4) == "null") {
+            pos_ += 4;
+        } else {
+            size_t end = pos_;
+            while (end < in_.size() && std::strchr("+-.0123456789eE", in_[end])) ++end;
+            std::string number(in_.substr(pos_, end - pos_));
+            char* parsed_end = nullptr;
+            value.type = JsonValue::NUMBER;
+            value.number = std::strtod(number.c_str(), &parsed_end);
+            if (number.empty() || parsed_end != number.c_str() + number.size()) fail("unexpected character");
+            pos_ = end;
+        }
+        return value;
+    }
+
+public:
+    static std::map<std::string, JsonValue> parse_object(std::string_view line) {
+        JsonParser parser(line);
+        std::map<std::string, JsonValue> object;
+        parser.expect('{');
+        if (!parser.consume('}')) {
+            do {
+                parser.skip_space();
+                std::string key = parser.parse_string();
+                parser.expect(':');
+                object[key] = parser.parse_value();
+            } while (parser.consume(','));
+            parser.expect('}');
+        }
+        parser.skip_space();
+        if (parser.pos_ != line.size()) parser.fail("trailing characters");
+        return object;
+    }
+};
+
+// Position of one client. Engines, caches and the golden database are shared by all
+// clients through the State. Unlike the REPL, `depth` is the depth at the position
+// reached by the moves.
+struct ServerSession {
+    std::string fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    std::vector<std::string> moves;
+    int depth = 1;
+};
+
+std::string json_string(const std::string& text) { return "\"" + json_escape(text) + "\""; }
+
+std::string json_string_array(const std::vector<std::string>& items) {
+    std::string out = "[";
+    for (size_t i = 0; i < items.size(); ++i) out += (i ? "," : "") + json_string(items[i]);
+    return out + "]";
+}
+
+std::string json_diff_rows(const DiffResult& diff) {
+    std::string out = "[";
+    for (size_t i = 0; i < diff.moves.size(); ++i) {
+        const DiffEntry& entry = diff.moves[i];
+        out += std::string(i ? "," : "") + "{\"move\":\"" + move_to_uci(entry.move) + "\"" +
+               ",\"user\":" + (entry.user ? std::to_string(*entry.user) : "null") +
+               ",\"reference\":" + (entry.reference ? std::to_string(*entry.reference) : "null");
+        std::string detail = entry.detail();
+        if (!detail.empty()) out += ",\"detail\":" + json_string(detail);
+        out += "}";
+    }
+    for (const auto& [move, nodes] : diff.unrecognised) {
+        out += std::string(out.size() > 1 ? "," : "") + "{\"move\":" + json_string(move) + ",\"user\":" + std::to_string(nodes) +
+               ",\"reference\":null}";
+    }
+    return out + "]";
+}
+
+// How each engine failed mid-query, for the engines that did.
+std::string json_crash(const DiffResult& diff) {
+    std::string out;
+    if (!diff.crash.first.empty()) out += ",\"user_crash\":" + json_string(diff.crash.first);
+    if (!diff.crash.second.empty()) out += ",\"reference_crash\":" + json_string(diff.crash.second);
+    return out;
+}
+
+bool diff_matches(const DiffResult& diff) {
+    bool match = !diff.aborted && !diff.crashed() && diff.unrecognised.empty() && diff.total_nodes.first == diff.total_nodes.second;
+    for (const auto& entry : diff.moves) match = match && entry.user && entry.reference && !entry.subtree_differs();
+    return match;
+}
+
+// Answers one request line with one response line. Request fields:
+//   id       echoed back as is
+//   cmd      "position", "diff", "divide" or "bisect"
+//   fen      sets the session FEN and clears its moves
+//   moves    sets the session moves (an array of UCI strings)
+//   depth    sets the session depth
+//   engine   for "divide": "user" (default) or "reference"
+// The session is updated before the command runs; "bisect" leaves it at the
+// diverging node, as autobisect does in the REPL.
+std::string handle_request(State& state, ServerSession& session, const std::string& line) {
+    std::string id = "null";
+    try {
+        auto request = JsonParser::parse_object(line);
+        auto field = [&](const char* name, JsonValue::Type type) -> const JsonValue* {
+            auto it = request.find(name);
+            if (it == request.end() || it->second.type == JsonValue::NUL) return nullptr;
+            if (it->second.type != type) throw std::runtime_error(std::string("field '") + name + "' has the wrong type");
+            return &it->second;
+        };
+        if (auto it = request.find("id"); it != request.end()) {
+            const JsonValue& value = it->second;
+            if (value.type == JsonValue::STRING) id = json_string(value.text);
+            else if (value.type == JsonValue::NUMBER) id = std::to_string(static_cast<long long>(value.number));
+        }
+        const JsonValue* command = field("cmd", JsonValue::STRING);
+        if (!command) throw std::runtime_error("missing 'cmd'");
+
+        ServerSession next = session;
+        if (const JsonValue* fen = field("fen", JsonValue::STRING)) {
+            next.fen = fen->text;
+            next.moves.clear();
+        }
+        if (const JsonValue* moves = field("moves", JsonValue::ARRAY)) {
+            next.moves.clear();
+            for (const auto& move : moves->items) {
+                if (move.type != JsonValue::STRING) throw std::runtime_error("'moves' must hold strings");
+                next.moves.push_back(move.text);
+            }
+        }
+        if (const JsonValue* depth = field("depth", JsonValue::NUMBER)) {
+            if (depth->number < 1 || depth->number > 64) throw std::runtime_error("'depth' must be between 1 and 64");
+            next.depth = static_cast<int>(depth->number);
+        }
+        Board board;
+        if (!board.parse_fen(next.fen)) throw std::runtime_error("invalid FEN '" + next.fen + "'");
+        for (const auto& move : next.moves) {
+            if (!board.apply_legal_uci(move)) throw std::runtime_error("illegal move '" + move + "'");
+        }
+        session = next;
+
+        std::string out = "{\"id\":" + id + ",\"ok\":true,\"cmd\":" + json_string(command->text);
+        auto position = [&] {
+            return ",\"fen\":" + json_string(session.fen) + ",\"moves\":" + json_string_array(session.moves) +
+                   ",\"depth\":" + std::to_string(session.depth);
+        };
+
+        if (command->text == "position") {
+            out += position() + ",\"node_fen\":" + json_string(board.fen());
+        } else if (command->text == "diff") {
+            DiffResult diff = state.compute_diff(session.fen, session.moves, session.depth);
+            out += position() + ",\"match\":" + (diff_matches(diff) ? "true" : "false") +
+                   ",\"user_total\":" + std::to_string(diff.total_nodes.first) +
+                   ",\"reference_total\":" + std::to_string(diff.total_nodes.second) + json_crash(diff) +
+                   ",\"divide\":" + json_diff_rows(diff);
+        } else if (command->text == "divide") {
+            const JsonValue* engine = field("engine", JsonValue::STRING);
+            std::string which = engine ? engine->text : "user";
+            if (which != "user" && which != "reference") throw std::runtime_error("'engine' must be 'user' or 'reference'");
+            PerftResult result = (which == "user" ? state.user_engine() : state.reference_engine())
+                                     .run_perft(session.fen, session.moves, session.depth);
+            out += position() + ",\"engine\":" + json_string(which) + ",\"total\":" + std::to_string(result.total_nodes);
+            if (!result.crash.empty()) out += ",\"crash\":" + json_string(result.crash);
+            out += ",\"divide\":[";
+            for (size_t i = 0; i < result.moves.size(); ++i) {
+                out += std::string(i ? "," : "") + "{\"move\":\"" + move_to_uci(result.moves[i].move) +
+                       "\",\"nodes\":" + std::to_string(result.moves[i].nodes) + "}";
+            }
+            for (const auto& [move, nodes] : result.unrecognised) {
+                out += std::string(out.back() == '[' ? "" : ",") + "{\"move\":" + json_string(move) + ",\"nodes\":" +
+                       std::to_string(nodes) + "}";
+            }
+            out += "]";
+        } else if (command->text == "bisect") {
+            while (true) {
+                LiveDiff live(state.early_abort() && session.depth > 1, false);
+                DiffResult diff = state.compute_diff(session.fen, session.moves, session.depth, &live);
+                if (diff.crashed()) {
+                    out += position() + ",\"result\":\"crash\"" + json_crash(diff);
+                    break;
+                }
+                if (diff.aborted) {
+                    session.moves.push_back(move_to_uci(*live.first_mismatch()));
+                    --session.depth;
+                    continue;
+                }
+                BisectStep step = bisect_step(diff);
+                bool lists_differ = !step.missing.empty() || !step.extra.empty();
+                if (!lists_differ && step.next_move.empty()) {
+                    bool totals_differ = diff.total_nodes.first != diff.total_nodes.second;
+                    out += position() + ",\"result\":" + (totals_differ ? "\"totals_differ\"" : "\"match\"");
+                    break;
+                }
+                if (session.depth == 1 || lists_differ) {
+                    Board node;
+                    node.parse_fen(session.fen);
+                    for (const auto& move : session.moves) node.apply_uci(move);
+                    out += position() + ",\"result\":\"divergence\",\"node_fen\":" + json_string(node.fen()) +
+                           ",\"missing\":" + json_string_array(step.missing) + ",\"extra\":" + json_string_array(step.extra);
+                    if (!lists_differ) out += ",\"mismatch\":" + json_string(step.next_move);
+                    out += ",\"divide\":" + json_diff_rows(diff);
+                    break;
+                }
+                session.moves.push_back(step.next_move);
+                --session.depth;
+            }
+        } else {
+            throw std::runtime_error("unknown command '" + command->text + "'");
+        }
+        return out + "}";
+    } catch (const std::exception& e) {
+        return "{\"id\":" + id + ",\"ok\":false,\"error\":" + json_string(e.what()) + "}";
+    }
+}
+
+#ifndef _WIN32
+std::atomic<int> SERVER_CLIENTS{0};
+
+// A daemon must not grow without bound: the query log keeps only the latest
+// queries, and a client whose request line outgrows this is dropped.
+constexpr size_t SERVER_QUERY_LOG_LIMIT = 10000;
+constexpr size_t MAX_REQUEST_LINE = 1 << 20;
+
+// Requests of one client are answered in order; clients run concurrently.
+void serve_client(State& state, int fd) {
+    std::cout << "Client connected (" << ++SERVER_CLIENTS << " active)." << std::endl;
+    ServerSession session;
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    auto send = [&](const std::string& response) {
+        for (size_t sent = 0; open && sent < response.size(); ) {
+            ssize_t written = write(fd, response.data() + sent, response.size() - sent);
+            if (written < 0 && errno == EINTR) continue;
+            open = written > 0;
+            if (open) sent += static_cast<size_t>(written);
+        }
+    };
+    while (open) {
+        ssize_t received = read(fd, chunk, sizeof(chunk));
+        if (received <= 0) break;
+        buffer.append(chunk, static_cast<size_t>(received));
+        for (size_t newline; open && (newline = buffer.find('\n')) != std::string::npos && newline <= MAX_REQUEST_LINE; ) {
+            std::string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.find_first_not_of(" \t") == std::string::npos) continue;
+            send(handle_request(state, session, line) + "\n");
+        }
+        if (open && buffer.size() > MAX_REQUEST_LINE) {
+            send("{\"id\":null,\"ok\":false,\"error\":\"request line longer than " + std::to_string(MAX_REQUEST_LINE) +
+                 " bytes\"}\n");
+            std::cout << "Dropping a client whose request line is too long." << std::endl;
+            break;
+        }
+    }
+    close(fd);
+    std::cout << "Client disconnected (" << --SERVER_CLIENTS << " active)." << std::endl;
+}
+
+int run_server(State& state, const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path '" << path << "' is too long." << std::endl;
+        return 1;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    auto* generic = reinterpret_cast<sockaddr*>(&address);
+
+    // A socket file left behind by a server that is gone is replaced; a live server
+    // or any other file at the path is not.
+    struct stat info {};
+    if (stat(path.c_str(), &info) == 0) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && connect(probe, generic, sizeof(address)) == 0;
+        if (probe >= 0) close(probe);
+        if (!S_ISSOCK(info.st_mode) || live) {
+            std::cerr << "Error: '" << path << "' is " << (live ? "in use by another server" : "not a socket") << "." << std::endl;
+            return 1;
+        }
+        unlink(path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, generic, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        std::cerr << "Error: cannot listen on '" << path << "': " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    QUERY_LOG.set_limit(SERVER_QUERY_LOG_LIMIT);
+    std::cout << "Listening on " << path << std::endl;
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "Error: accept failed: " << std::strerror(errno) << std::endl;
+            close(listener);
+            return 1;
+        }
+        std::thread(serve_client, std::ref(state), client).detach();
+    }
+}
+#endif
+
 // =================================================================================
 // Main Application Loop
 // =================================================================================
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " <path_to_your_chess_engine> [options]\n"
+              << "The engine is an executable, or a shared library (.so/.dylib/.dll) exporting the plugin ABI.\n"
+              << "Options:\n"
+              << "  --persistent        Keep one engine process alive and send queries over stdin.\n"
+              << "  --reference <name>  Reference engine: 'stockfish' (default) or 'builtin'.\n"
+              << "  --threads <N>       Worker threads for parallel work (default: all cores).\n"
+              << "  --suite <file.epd>  Check the engine against an EPD perft suite and exit.\n"
+              << "  --suite-depth <N>   Skip suite entries deeper than N.\n"
+              << "  --bench             Run the benchmark and exit.\n"
+              << "  --bench-runs <N>    Timed runs per engine and position (default: 5).\n"
+              << "  --bench-against <p> Second engine build to compare against the first.\n"
+              << "  --bench-json <file> Also write the benchmark results as JSON.\n"
+              << "  --fan-out <N>       Split each query by root move over N engine processes.\n"
+              << "  --sf-pool <N>       Split Stockfish queries by root move over N processes.\n"
+              << "  --early-abort       Stop both engines as soon as a root move mismatches.\n"
+              << "  --checkpoint <path> Record finished root moves of each diff here, for 'resume'.\n"
+              << "  --checksum          Compare a checksum of each subtree's leaves, not just counts.\n"
+              << "  --breakdown         Also compare captures, ep, castles, promotions, checks, mates.\n"
+              << "  --no-cache          Always re-run both engines, even for repeated queries.\n"
+              << "  --cache-file <path> Load and save cached results in this file.\n"
+              << "  --golden <file>     Answer reference queries from a golden database where possible.\n"
+              << "  --serve <socket>    Answer JSON-lines requests on a Unix socket instead of the prompt.\n"
+              << "Golden database generation (no engine argument needed):\n"
+              << "  --golden-build <f>  Write a golden database of the standard positions and exit.\n"
+              << "                      With --suite, use the suite's positions and depths instead.\n"
+              << "  --golden-oracle <e> Engine to trust: 'stockfish' (default), 'builtin' or an engine path.\n"
+              << "  --golden-depth <N>  Depth for every position (default: each position's own).\n"
+              << "  --golden-plies <N>  Also store the positions up to N moves below each one (default: 1).\n";
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <path_to_your_chess_engine>" << std::endl;
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--persistent") {
+            options.persistent = true;
+        } else if (arg == "--reference" && i + 1 < argc) {
+            options.reference = argv[++i];
+            if (options.reference != "stockfish" && options.reference != "builtin") {
+                std::cerr << "Unknown reference engine: '" << options.reference << "'" << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            int threads = std::atoi(argv[++i]);
+            if (threads <= 0) {
+                std::cerr << "Error: --threads needs a positive integer." << std::endl;
+                return 1;
+            }
+            options.threads = static_cast<unsigned>(threads);
+        } else if (arg == "--suite" && i + 1 < argc) {
+            options.suite_file = argv[++i];
+        } else if (arg == "--suite-depth" && i + 1 < argc) {
+            options.suite_depth = std::atoi(argv[++i]);
+        } else if (arg == "--bench") {
+            options.bench = true;
+        } else if (arg == "--bench-runs" && i + 1 < argc) {
+            options.bench_runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--bench-against" && i + 1 < argc) {
+            options.bench_against = argv[++i];
+        } else if (arg == "--bench-json" && i + 1 < argc) {
+            options.bench_json = argv[++i];
+        } else if (arg == "--fan-out" && i + 1 < argc) {
+            int processes = std::atoi(argv[++i]);
+            if (processes <= 0) {
+                std::cerr << "Error: --fan-out needs a positive integer." << std::endl;
+                return 1;
+            }
+            options.fan_out = static_cast<unsigned>(processes);
+        } else if (arg == "--sf-pool" && i + 1 < argc) {
+            int processes = std::atoi(argv[++i]);
+            if (processes <= 0) {
+                std::cerr << "Error: --sf-pool needs a positive integer." << std::endl;
+                return 1;
+            }
+            options.stockfish_pool = static_cast<unsigned>(processes);
+        } else if (arg == "--early-abort") {
+            options.early_abort = true;
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            options.checkpoint_file = argv[++i];
+        } else if (arg == "--checksum") {
+            options.checksum = true;
+        } else if (arg == "--breakdown") {
+            options.breakdown = true;
+        } else if (arg == "--no-cache") {
+            options.use_cache = false;
+        } else if (arg == "--cache-file" && i + 1 < argc) {
+            options.cache_file = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            options.serve_socket = argv[++i];
+        } else if (arg == "--golden" && i + 1 < argc) {
+            options.golden_file = argv[++i];
+        } else if (arg == "--golden-build" && i + 1 < argc) {
+            options.golden_build = argv[++i];
+        } else if (arg == "--golden-oracle" && i + 1 < argc) {
+            options.golden_oracle = argv[++i];
+        } else if (arg == "--golden-depth" && i + 1 < argc) {
+            options.golden_depth = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--golden-plies" && i + 1 < argc) {
+            options.golden_plies = std::max(0, std::atoi(argv[++i]));
+        } else if (options.user_engine_path.empty() && arg.rfind("--", 0) != 0) {
+            options.user_engine_path = arg;
+        } else {
+            std::cerr << "Unknown argument: '" << arg << "'" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.user_engine_path.empty() && options.golden_build.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+#ifndef _WIN32
+    // A dead engine must not take the debugger down with it when we write to its stdin.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // The suite, the benchmark and the golden database compare node counts only.
+    if ((options.checksum || options.breakdown) && (!options.golden_build.empty() || !options.suite_file.empty() || options.bench)) {
+        std::cerr << "Error: --checksum and --breakdown cannot be combined with --suite, --bench or --golden-build, "
+                  << "which compare node counts only." << std::endl;
         return 1;
     }
+
+    if (!options.golden_build.empty()) {
+        try {
+            return run_golden_build(options);
+        } catch (const std::exception& e) {
+            std::cerr << Color::ORANGE << "FATAL ERROR: " << e.what() << Color::RESET << std::endl;
+            return 1;
+        }
+    }
+
+    if (!options.suite_file.empty() || options.bench) {
+        try {
+            return options.bench ? run_bench(options, options.bench_runs) : run_suite(options);
+        } catch (const std::exception& e) {
+            std::cerr << Color::ORANGE << "FATAL ERROR: " << e.what() << Color::RESET << std::endl;
+            return 1;
+        }
+    }
     
+    if (options.checksum || options.breakdown) {
+        // Stockfish reports neither; the built-in engine computes them with the counts.
+        if (options.reference != "builtin") {
+            std::cout << (options.checksum ? "Checksum" : "Breakdown") << " mode: using the built-in reference engine." << std::endl;
+            options.reference = "builtin";
+        }
+        // Engine processes, persistent ones included, inherit the environment.
+#ifdef _WIN32
+        if (options.checksum) _putenv_s("PERFT_CHECKSUM", "1");
+        if (options.breakdown) _putenv_s("PERFT_BREAKDOWN", "1");
+#else
+        if (options.checksum) setenv("PERFT_CHECKSUM", "1", 1);
+        if (options.breakdown) setenv("PERFT_BREAKDOWN", "1", 1);
+#endif
+        if (!options.golden_file.empty()) {
+            std::cout << "The golden database holds plain counts only; it is not used in this mode." << std::endl;
+            options.golden_file.clear();
+        }
+        if (options.breakdown && is_plugin_path(options.user_engine_path)) {
+            std::cerr << Color::ORANGE << "Warning: plugin engines report no breakdown; only counts"
+                      << (options.checksum ? " and checksums" : "") << " will be compared." << Color::RESET << std::endl;
+        }
+    }
+
+    if (!options.serve_socket.empty()) {
+#ifdef _WIN32
+        std::cerr << "Error: --serve needs Unix domain sockets, which this build does not support." << std::endl;
+        return 1;
+#else
+        try {
+            State state(options);
+            return run_server(state, options.serve_socket);
+        } catch (const std::exception& e) {
+            std::cerr << Color::ORANGE << "FATAL ERROR: " << e.what() << Color::RESET << std::endl;
+            return 1;
+        }
+#endif
+    }
+
     print_help(); // Print help before starting, so user always sees it.
 
     try {
-        State state(argv[1]);
+        State state(options);
         std::string line;
         while (true) {
             if (IS_TTY) std::cout << "> " << std::flush;
@@ -503,6 +4651,61 @@ int main(int argc, char* argv[]) {
                 }
             } else if (command == "diff") {
                 state.run_diff();
+            } else if (command == "resume") {
+                state.resume();
+            } else if (command == "autobisect" || command == "bisect") {
+                state.run_autobisect();
+            } else if (command == "mindepth") {
+                state.run_mindepth();
+            } else if (command == "findall") {
+                state.run_findall();
+            } else if (command == "cache") {
+                std::string sub;
+                ss >> sub;
+                if (!state.cache()) {
+                    std::cout << "Result cache is disabled." << std::endl;
+                } else if (sub == "clear") {
+                    state.cache()->clear();
+                    std::cout << "Cache cleared." << std::endl;
+                } else {
+                    state.cache()->print_stats();
+                }
+                if (state.golden() && sub != "clear") state.golden()->print_stats();
+            } else if (command == "minimize" || command == "minimise") {
+                run_minimize(state);
+            } else if (command == "fuzz") {
+                double seconds = 30;
+                int depth = 2;
+                ss >> seconds >> depth;
+                // Seeds: the current node and the standard perft positions.
+                std::vector<std::string> seeds{state.position_at(state.moves()).second};
+                for (const auto& position : BENCH_POSITIONS) seeds.push_back(position.fen);
+                run_fuzz(state, seeds, std::max(1.0, seconds), std::max(1, depth));
+            } else if (command == "stats") {
+                std::string sub, path;
+                ss >> sub >> path;
+                if (sub.empty()) {
+                    QUERY_LOG.print_summary();
+                } else if (sub == "clear") {
+                    QUERY_LOG.clear();
+                    std::cout << "Statistics cleared." << std::endl;
+                } else if ((sub == "csv" || sub == "json") && !path.empty()) {
+                    bool written = sub == "csv" ? QUERY_LOG.write_csv(path) : QUERY_LOG.write_json(path);
+                    if (written) std::cout << "Statistics written to " << path << "." << std::endl;
+                    else std::cerr << "Error: cannot write '" << path << "'." << std::endl;
+                } else {
+                    std::cerr << "Error: Use 'stats', 'stats clear', 'stats csv <file>' or 'stats json <file>'." << std::endl;
+                }
+            } else if (command == "abort") {
+                std::string sub;
+                ss >> sub;
+                if (sub == "on" || sub == "off") state.set_early_abort(sub == "on");
+                else if (!sub.empty()) std::cerr << "Error: Use 'abort on' or 'abort off'." << std::endl;
+                std::cout << "Early abort is " << (state.early_abort() ? "on" : "off") << "." << std::endl;
+            } else if (command == "bench") {
+                int runs = options.bench_runs;
+                ss >> runs;
+                run_bench(options, std::max(1, runs));
             } else if (command == "help") {
                 print_help();
             } else if (command == "exit" || command == "quit") {